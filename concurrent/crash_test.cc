@@ -0,0 +1,408 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+#include "masstree.h"
+
+/* Crash injection for the durable concurrent tree, linked against
+   masstree.cc built with -DCRASH_SIM, which puts nodes in the built-in
+   persistent heap. The heap file is mapped as usual; beside it the test
+   keeps a durable image that a flushed line reaches at the next fence.
+   Every flush and every fence is a crash point. At a crash point the
+   process forks; the child swaps the mapping for a private copy of a crash
+   image, opens the tree again, which runs recovery, and checks every key
+   against the operations that had returned, while the parent carries on.
+   Besides the image of what was fenced, each point gets random images in
+   which dirty and flushed but unfenced lines may or may not have been
+   written back. The workload runs on one thread.
+
+   usage: crash_test [keys] [crashes] [seed] [images]
+   crashes is the number of points sampled, 0 replays all of them */
+
+#define SIM_IMAGE   (1ULL << 30)
+#define SIM_SLACK   (64ULL << 20)
+#define SIM_LINE    64
+#define MAX_REPORTS 20
+
+static __uint128_t g_lehmer64_state;
+
+static uint64_t lehmer64() {
+  g_lehmer64_state *= 0xda942042e4dd58b5;
+  return g_lehmer64_state >> 64;
+}
+
+/* the heap as mapped, its durable image and the lines flushed since the
+   last fence */
+static char *heap = reinterpret_cast<char *>(PHEAP_BASE);
+static char *image;
+static char path[64];
+static vector<char *> pending;
+static vector<char> pending_data;
+
+/* crash points */
+static u_int64_t points;
+static vector<u_int64_t> targets;
+static size_t next_target;
+static int images = 1;
+static u_int64_t crashes, failures;
+static map<void *, pair<u_int64_t, u_int64_t> > sites;
+
+/* the workload and what the tree must hold */
+static masstree::btree *tree;
+static vector<u_int64_t> keys;
+static vector<char> present;
+static long inflight = -1;
+static long op_index;
+static const char *op_name = "create";
+
+static void crash(void *site, const char *kind);
+
+static void crash_point(void *site, const char *kind)
+{
+    if(next_target<targets.size() && targets[next_target]==points)
+    {
+        next_target++;
+        crash(site,kind);
+    }
+    points++;
+}
+
+namespace masstree
+{
+    void sim_flush(void *line, void *site)
+    {
+        crash_point(site,"flush");
+        if((char *)line<heap || (char *)line>=heap+SIM_IMAGE)
+            return;
+        pending.push_back((char *)line);
+        pending_data.insert(pending_data.end(),(char *)line,(char *)line+SIM_LINE);
+    }
+
+    void sim_fence(void *site)
+    {
+        crash_point(site,"fence");
+        for(size_t i=0; i<pending.size(); i++)
+            memcpy(image+(pending[i]-heap),&pending_data[i*SIM_LINE],SIM_LINE);
+        pending.clear();
+        pending_data.clear();
+    }
+}
+
+/* values are the caller's to persist, they do not take part in the crash */
+static void persist(void *ptr, size_t len)
+{
+    size_t off = (char *)ptr-heap;
+    memcpy(image+off,heap+off,len);
+}
+
+static void site_name(void *site, char *buf, size_t len)
+{
+    Dl_info info;
+    if(dladdr(site,&info) && info.dli_sname)
+    {
+        int status;
+        char *name = abi::__cxa_demangle(info.dli_sname,NULL,NULL,&status);
+        snprintf(buf,len,"%s+0x%lx",status==0 ? name : info.dli_sname,
+                 (unsigned long)((char *)site-(char *)info.dli_saddr));
+        free(name);
+    } else
+        snprintf(buf,len,"%p",site);
+}
+
+/* turns the heap into what a crash could have left: image 0 holds only
+   what was fenced, the others take each unsettled line from the image,
+   the working memory or its pending flush at random. The result replaces
+   the shared mapping with a private one, so the parent's file is left
+   alone. */
+static void crash_image(int n)
+{
+    /* whole lines, the heap hands out 16B aligned blocks */
+    size_t used = (masstree::pheap_used()+SIM_LINE-1) & ~(size_t)(SIM_LINE-1);
+    char *work = (char *)malloc(used);
+
+    memcpy(work,heap,used);
+    if(n==0)
+        memcpy(work,image,used);
+    else
+    {
+        map<size_t, size_t> flushed;
+        for(size_t i=0; i<pending.size(); i++)
+            flushed[pending[i]-heap] = i;
+        g_lehmer64_state = (points<<8) ^ n ^ 0x9e3779b97f4a7c15ULL;
+        for(size_t off=0; off<used; off+=SIM_LINE)
+        {
+            map<size_t, size_t>::iterator it = flushed.find(off);
+            int choices = it==flushed.end() ? 2 : 3;
+            if(it==flushed.end() && memcmp(work+off,image+off,SIM_LINE)==0)
+                continue;
+            switch(lehmer64()%choices)
+            {
+                case 0:
+                    memcpy(work+off,image+off,SIM_LINE);
+                    break;
+                case 2:
+                    memcpy(work+off,&pending_data[it->second*SIM_LINE],SIM_LINE);
+                    break;
+            }
+        }
+    }
+    if(mmap(heap,used+SIM_SLACK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0)!=heap)
+    {
+        perror("mmap");
+        _exit(2);
+    }
+    memcpy(heap,work,used);
+    free(work);
+}
+
+static bool check_keys()
+{
+    u_int64_t found = 0, scanned = 0, prev = 0;
+
+    for(size_t i=0; i<keys.size(); i++)
+    {
+        void *value = tree->get(keys[i]);
+        if(value!=NULL && *(u_int64_t *)value!=keys[i])
+        {
+            fprintf(stderr,"key %lx has a wrong value\n",keys[i]);
+            return false;
+        }
+        if((long)i!=inflight && (value!=NULL)!=(bool)present[i])
+        {
+            fprintf(stderr,"key %lx is %s\n",keys[i],present[i] ? "lost" : "back after its remove");
+            return false;
+        }
+        found += value!=NULL;
+    }
+    for(masstree::btree::iterator it=tree->begin(); it.valid(); ++it, scanned++)
+    {
+        if((scanned>0 && it.key()<=prev) || tree->get(it.key())!=it.value())
+        {
+            fprintf(stderr,"scan returns %lx out of order or with a stale value\n",it.key());
+            return false;
+        }
+        prev = it.key();
+    }
+    if(scanned!=found)
+    {
+        fprintf(stderr,"scan finds %lu keys, lookups %lu\n",scanned,found);
+        return false;
+    }
+    scanned = 0;
+    for(masstree::btree::reverse_iterator it=tree->rbegin(); it.valid(); ++it, scanned++)
+    {
+        if((scanned>0 && it.key()>=prev) || tree->get(it.key())!=it.value())
+        {
+            fprintf(stderr,"reverse scan returns %lx out of order or with a stale value\n",it.key());
+            return false;
+        }
+        prev = it.key();
+    }
+    if(scanned!=found)
+    {
+        fprintf(stderr,"reverse scan finds %lu keys, lookups %lu\n",scanned,found);
+        return false;
+    }
+    return true;
+}
+
+static void toggle(size_t i)
+{
+    inflight = i;
+    if(present[i])
+    {
+        op_name = "remove";
+        tree->remove(keys[i]);
+    } else
+    {
+        op_name = "insert";
+        u_int64_t *value = (u_int64_t *)masstree::pheap_malloc(sizeof(u_int64_t));
+        *value = keys[i];
+        persist(value,sizeof(u_int64_t));
+        if(!tree->insert(keys[i],value))
+            masstree::pheap_free(value);
+    }
+    present[i] = !present[i];
+    inflight = -1;
+    op_index++;
+}
+
+/* runs in the child on the crash image */
+static int replay()
+{
+    targets.clear();
+    alarm(10);
+    masstree::sim_restart();
+    tree = masstree::btree::open(path);
+    if(tree==NULL || !check_keys())
+        return 1;
+
+    /* the recovered tree must take further work */
+    if(inflight>=0)
+        present[inflight] = tree->get(keys[inflight])!=NULL;
+    inflight = -1;
+    for(size_t i=0; i<keys.size(); i+=3)
+        toggle(i);
+    if(!check_keys())
+    {
+        fprintf(stderr,"after more operations on the recovered tree\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void crash(void *site, const char *kind)
+{
+    if(tree==NULL)
+        return;
+    for(int n=0; n<=images; n++)
+    {
+        int status;
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid==0)
+        {
+            crash_image(n);
+            _exit(replay());
+        }
+        waitpid(pid,&status,0);
+        crashes++;
+        sites[site].first++;
+        if(WIFEXITED(status) && WEXITSTATUS(status)==0)
+            continue;
+        failures++;
+        sites[site].second++;
+        if(failures<=MAX_REPORTS)
+        {
+            char name[256];
+            site_name(site,name,sizeof(name));
+            printf("FAILED at point %lu, image %d: %s in %s during op %ld (%s %lx)",
+                   points,n,kind,name,op_index,op_name,inflight<0 ? 0 : keys[inflight]);
+            if(WIFSIGNALED(status))
+                printf(", killed by signal %d",WTERMSIG(status));
+            printf("\n");
+        }
+    }
+}
+
+/* inserts every key, toggles random ones, then removes what is left */
+static void run(u_int64_t seed)
+{
+    size_t n = keys.size();
+    vector<size_t> order(n);
+
+    g_lehmer64_state = seed;
+    present.assign(n,0);
+    op_index = 0;
+    op_name = "create";
+    tree = NULL;
+    unlink(path);
+    tree = masstree::btree::open(path);
+    if(tree==NULL)
+    {
+        fprintf(stderr,"cannot open a heap at %s\n",path);
+        exit(1);
+    }
+
+    for(size_t i=0; i<n; i++)
+        order[i] = i;
+    for(size_t i=n-1; i>0; i--)
+        swap(order[i],order[lehmer64()%(i+1)]);
+    for(size_t i=0; i<n; i++)
+        toggle(order[i]);
+    for(size_t i=0; i<n; i++)
+        toggle(lehmer64()%n);
+    for(size_t i=n-1; i>0; i--)
+        swap(order[i],order[lehmer64()%(i+1)]);
+    for(size_t i=0; i<n; i++)
+        if(present[order[i]])
+            toggle(order[i]);
+}
+
+int main(int argc, char **argv)
+{
+    int num_keys = 1000;
+    u_int64_t num_crashes = 0;
+    u_int64_t seed = time(NULL);
+    u_int64_t total;
+    int fd[2], status;
+    if(argc>1)
+        num_keys = atoi(argv[1]);
+    if(argc>2)
+        num_crashes = atoll(argv[2]);
+    if(argc>3)
+        seed = atoll(argv[3]);
+    if(argc>4)
+        images = atoi(argv[4]);
+
+    snprintf(path,sizeof(path),"/tmp/crash_test.%d.heap",(int)getpid());
+    image = (char *)mmap(NULL,SIM_IMAGE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(image==MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    g_lehmer64_state = seed|1;
+    for(int i=0; i<num_keys; i++)
+        keys.push_back(lehmer64());
+
+    /* a clean run counts the points and checks the tree without crashes;
+       a process maps one heap, so it runs in a child of its own */
+    if(pipe(fd))
+    {
+        perror("pipe");
+        return 1;
+    }
+    if(fork()==0)
+    {
+        run(seed|1);
+        total = points;
+        if(!check_keys())
+            total = 0;
+        if(write(fd[1],&total,sizeof(total))!=sizeof(total))
+            _exit(1);
+        _exit(0);
+    }
+    wait(&status);
+    if(read(fd[0],&total,sizeof(total))!=sizeof(total) || total==0)
+    {
+        printf("the tree is broken without a crash (seed %lu)\n",seed);
+        unlink(path);
+        return 1;
+    }
+
+    g_lehmer64_state = seed^0x5bd1e995;
+    if(num_crashes==0 || num_crashes>=total)
+        for(u_int64_t p=0; p<total; p++)
+            targets.push_back(p);
+    else
+    {
+        for(u_int64_t i=0; i<num_crashes; i++)
+            targets.push_back(lehmer64()%total);
+        sort(targets.begin(),targets.end());
+        targets.erase(unique(targets.begin(),targets.end()),targets.end());
+    }
+    cout<<"keys: "<<num_keys<<", seed: "<<seed<<", crash points: "<<total
+        <<", replaying "<<targets.size()<<" with "<<images+1<<" images each\n";
+
+    run(seed|1);
+    unlink(path);
+
+    cout<<"crashes: "<<crashes<<", failures: "<<failures<<"\n";
+    for(map<void *, pair<u_int64_t, u_int64_t> >::iterator it=sites.begin(); it!=sites.end(); ++it)
+    {
+        char name[256];
+        site_name(it->first,name,sizeof(name));
+        printf("  %-60s %8lu crashes %8lu failed\n",name,it->second.first,it->second.second);
+    }
+    return failures!=0;
+}
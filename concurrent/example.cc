@@ -75,7 +75,7 @@ int main(int argc, char **argv)
         //key=lehmer64();
         key+=10;
         keys[i]=key;
-        values[i]=malloc(4);
+        values[i]=SET_IV(i);
         //cout<<"insert: "<<i<<endl;
     }
 
@@ -3,9 +3,12 @@
 #ifdef DRAM
 #define RRP_free free 
 #define RRP_malloc malloc
-#else
+#elif defined(RALLOC)
 #define RRP_free RP_free
 #define RRP_malloc RP_malloc
+#else
+#define RRP_free pheap_free
+#define RRP_malloc pheap_malloc
 #endif
 
 namespace masstree
@@ -20,22 +23,116 @@ namespace masstree
         asm volatile("sfence":::"memory");
     }
 
-    static inline void clflush(char *data, int len, bool front, bool back)
+    /* cache line write back, picked at startup like the search kernels */
+    static flush_isa detect_flush_isa()
     {
-        volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-        if (front)
-            mfence();
-        for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
-    #ifdef CLFLUSH
-            asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-    #elif CLFLUSH_OPT
-            asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(ptr)));
-    #elif CLWB
-            asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(ptr)));
-    #endif
-        }
-        if (back)
+        unsigned int a, b, c, d;
+        if(__get_cpuid_count(7,0,&a,&b,&c,&d))
+        {
+            if(b & bit_CLWB)
+                return FLUSH_CLWB;
+            if(b & bit_CLFLUSHOPT)
+                return FLUSH_CLFLUSHOPT;
+        }
+        return FLUSH_CLFLUSH;
+    }
+
+    static flush_isa max_flush = detect_flush_isa();
+    static flush_isa active_flush = max_flush;
+
+    flush_isa get_flush_isa()
+    {
+        return active_flush;
+    }
+
+    bool set_flush_isa(flush_isa isa)
+    {
+        if(isa>max_flush)
+            return false;
+        active_flush=isa;
+        return true;
+    }
+
+    static inline void write_back(char *line)
+    {
+        switch(active_flush)
+        {
+            case FLUSH_CLWB:
+                asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+                break;
+            case FLUSH_CLFLUSHOPT:
+                asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+                break;
+            case FLUSH_CLFLUSH:
+                asm volatile("clflush %0" : "+m" (*(volatile char *)line));
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* Persistence ordering, as in the single threaded tree: persist() only
+       records the cache lines a store touched, persist_fence() writes them
+       back and fences once. A DRAM build persists nothing. Each thread has
+       its own set, and a thread writes back what it stored before it
+       releases the locks covering it. */
+#ifndef DRAM
+    static thread_local struct
+    {
+        char    *line[FLUSH_SET];
+        int     n;
+        bool    unfenced;
+    } flush_set;
+
+    /* out of line so that under CRASH_SIM the return address names the
+       writer that persists */
+    __attribute__((noinline)) static void flush_set_drain(bool fence)
+    {
+#ifdef CRASH_SIM
+        void *site = __builtin_return_address(0);
+        for(int i=0; i<flush_set.n; i++)
+            sim_flush(flush_set.line[i],site);
+        if(fence)
+            sim_fence(site);
+#else
+        for(int i=0; i<flush_set.n; i++)
+            write_back(flush_set.line[i]);
+        if(fence)
             mfence();
+#endif
+        flush_set.n = 0;
+        flush_set.unfenced = !fence;
+    }
+#endif
+
+    __attribute__((always_inline)) static inline void persist(void *data, int len)
+    {
+#ifndef DRAM
+        if(active_flush==FLUSH_NONE)
+            return;
+        char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+        for(; ptr<(char *)data+len; ptr+=CACHE_LINE_SIZE)
+        {
+            int i;
+            for(i=0; i<flush_set.n && flush_set.line[i]!=ptr; i++);
+            if(i<flush_set.n)
+                continue;
+            if(flush_set.n==FLUSH_SET)
+                flush_set_drain(false);
+            flush_set.line[flush_set.n++] = ptr;
+        }
+#else
+        (void)data;
+        (void)len;
+#endif
+    }
+
+    __attribute__((always_inline)) static inline void persist_fence()
+    {
+#ifndef DRAM
+        if(flush_set.n>0 || flush_set.unfenced)
+            flush_set_drain(true);
+#endif
     }
 
     static inline void movnt64(uint64_t *dest, uint64_t const &src, bool front, bool back) {
@@ -45,12 +142,40 @@ namespace masstree
         if (back) mfence();
     }
 
+#ifdef SPLIT_KV
+    __attribute__((always_inline)) static inline void persist_entry(kv_ref e)
+    {
+        persist(&e.key, sizeof(u_int64_t));
+        persist(&e.link_or_value, sizeof(void *));
+    }
+#else
+    __attribute__((always_inline)) static inline void persist_entry(kv &e)
+    {
+        persist(&e, sizeof(kv));
+    }
+#endif
+
+    /* node headers sit in the first cache line of their NODE_ALIGN slot:
+       the lock word and the permutation persist together */
+    __attribute__((always_inline)) static inline void persist_header(void *node)
+    {
+        persist(node, CACHE_LINE_SIZE);
+    }
+
     static inline void prefetch_(const void *ptr)
     {
         typedef struct { char x[CACHE_LINE_SIZE]; } cacheline_t;
         asm volatile("prefetcht0 %0" : : "m" (*(const cacheline_t *)ptr));
     }
 
+    static inline void prefetch_node(const void *node)
+    {
+        const char *p = reinterpret_cast<const char *>(node);
+        for(uint64_t off=0; off<sizeof(inner_node); off+=CACHE_LINE_SIZE)
+            prefetch_(p+off);
+        prefetch_(p+sizeof(inner_node)-1);
+    }
+
     uint64_t lock_version=100;
     VersionNumber::VersionNumber():
     v(lock_version<<44) 
@@ -58,29 +183,468 @@ namespace masstree
 
     bool VersionNumber::repair_req()
     {
-        return (smoLock()||insertLock())&&(lockVersion()!=lock_version);
+        uint64_t current = v;
+        return (current&BOTH_LOCKS) && ((current&LOCK_VERSION)>>44)!=lock_version;
     }
 
+    /* stamps the current lock_version, dropping locks whose owner died with
+       an earlier run; those can only be leaf insert locks, whose changes are
+       published by a single permutation store, since open() repaired every
+       node an interrupted SMO held. Returns the lock version found. */
     uint VersionNumber::updateLock() {
-        volatile uint64_t current = *(volatile uint64_t*)&v;
-        uint temp = (current&LOCK_VERSION)>>44;
-        if(temp==lock_version)
-            return temp;
-        return (__sync_val_compare_and_swap(&v,current,(current&LOCK_RESET)|(lock_version<<44)|INSERT_LOCK) & LOCK_VERSION)>>44;
+        uint64_t current;
+        uint temp;
+        while(1) {
+            current = v;
+            temp = (current&LOCK_VERSION)>>44;
+            if(temp==lock_version)
+                return temp;
+            if(__sync_bool_compare_and_swap(&v,current,(current&LOCK_RESET&~BOTH_LOCKS)|(lock_version<<44)))
+                return temp;
+        }
+    }
+
+    /* The search kernels compare the probe against every physical slot of a
+       node at once. With SPLIT_KV the slot keys are contiguous, otherwise kv
+       is {key, link_or_value} and they sit at the even u_int64_t offsets of
+       the entry array. The compares give a mask, in
+       slot order, of the keys below the probe; shuffling it by the permutation
+       puts it in sorted order, where it is a prefix whose length is the rank.
+       Free slots sort past size() and are masked off, so neither a branch nor
+       a loop over the permutation is needed. */
+
+    __attribute__((target("sse4.2")))
+    static inline int rank_sse42(uint64_t perm, uint32_t lt, uint32_t eq, int &eqp)
+    {
+        /* one byte per permutation element, element i in byte i */
+        __m128i v = _mm_cvtsi64_si128(perm>>4);
+        __m128i order = _mm_unpacklo_epi8(_mm_and_si128(v,_mm_set1_epi8(0x0f)),
+                                          _mm_and_si128(_mm_srli_epi64(v,4),_mm_set1_epi8(0x0f)));
+        /* one byte per slot, 0xff where the slot key is below the probe */
+        const __m128i bits = _mm_set1_epi64x(0x8040201008040201LL);
+        __m128i m = _mm_shuffle_epi8(_mm_cvtsi32_si128(lt), _mm_set_epi8(1,1,1,1,1,1,1,1,0,0,0,0,0,0,0,0));
+        m = _mm_cmpeq_epi8(_mm_and_si128(m,bits),bits);
+        int n = permuter::size(perm);
+        int rank = __builtin_popcount(_mm_movemask_epi8(_mm_shuffle_epi8(m,order)) & ((1<<n)-1));
+        eqp = -1;
+        if(rank<n) {
+            /* rank==LEAF_WIDTH would shift perm by 64 */
+            int p = (perm>>((rank<<2)+4)) & LEAF_WIDTH;
+            if((eq>>p)&1)
+                eqp = p;
+        }
+        return rank;
+    }
+
+#ifdef SPLIT_KV
+    __attribute__((target("sse4.2")))
+    static int simd_rank_sse42(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        /* pcmpgtq is signed, flipping the sign bit gives the unsigned order */
+        const __m128i flip = _mm_set1_epi64x(0x8000000000000000LL);
+        const __m128i k = _mm_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        /* the 16th lane reads link_or_value[0] and is masked off below */
+        for(int i=0; i<=LEAF_WIDTH; i+=2)
+        {
+            __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(slots+i)),flip);
+            lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(k,s))) << i;
+        }
+        return rank_sse42(perm,lt&((1<<LEAF_WIDTH)-1),eq&((1<<LEAF_WIDTH)-1),eqp);
+    }
+
+    __attribute__((target("avx2")))
+    static int simd_rank_avx2(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        const __m256i flip = _mm256_set1_epi64x(0x8000000000000000LL);
+        const __m256i k = _mm256_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<=LEAF_WIDTH; i+=4)
+        {
+            __m256i s = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(slots+i)),flip);
+            lt |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k,s))) << i;
+        }
+        return rank_sse42(perm,lt&((1<<LEAF_WIDTH)-1),eq&((1<<LEAF_WIDTH)-1),eqp);
+    }
+#else
+    __attribute__((target("sse4.2")))
+    static int simd_rank_sse42(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        /* pcmpgtq is signed, flipping the sign bit gives the unsigned order */
+        const __m128i flip = _mm_set1_epi64x(0x8000000000000000LL);
+        const __m128i k = _mm_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<LEAF_WIDTH-1; i+=2)
+        {
+            __m128i s = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)(slots+(i<<1))),
+                                           _mm_loadu_si128((const __m128i *)(slots+(i<<1)+2)));
+            s = _mm_xor_si128(s,flip);
+            lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(k,s))) << i;
+        }
+        lt |= (uint32_t)(slots[(LEAF_WIDTH-1)<<1]<key) << (LEAF_WIDTH-1);
+        eq |= (uint32_t)(slots[(LEAF_WIDTH-1)<<1]==key) << (LEAF_WIDTH-1);
+        return rank_sse42(perm,lt,eq,eqp);
+    }
+
+    __attribute__((target("avx2")))
+    static int simd_rank_avx2(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        const __m256i flip = _mm256_set1_epi64x(0x8000000000000000LL);
+        const __m256i k = _mm256_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<12; i+=4)
+        {
+            /* unpacklo gives keys i, i+2, i+1, i+3; restore slot order */
+            __m256i s = _mm256_unpacklo_epi64(_mm256_loadu_si256((const __m256i *)(slots+(i<<1))),
+                                              _mm256_loadu_si256((const __m256i *)(slots+(i<<1)+4)));
+            s = _mm256_xor_si256(_mm256_permute4x64_epi64(s,_MM_SHUFFLE(3,1,2,0)),flip);
+            lt |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k,s))) << i;
+        }
+        __m128i s = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)(slots+24)),
+                                       _mm_loadu_si128((const __m128i *)(slots+26)));
+        s = _mm_xor_si128(s,_mm256_castsi256_si128(flip));
+        lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm256_castsi256_si128(k),s))) << 12;
+        eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm256_castsi256_si128(k),s))) << 12;
+        lt |= (uint32_t)(slots[28]<key) << 14;
+        eq |= (uint32_t)(slots[28]==key) << 14;
+        return rank_sse42(perm,lt,eq,eqp);
+    }
+#endif
+
+    static search_isa detect_search_isa()
+    {
+#ifdef SIMD_SEARCH
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return SEARCH_AVX2;
+        if(__builtin_cpu_supports("sse4.2"))
+            return SEARCH_SSE42;
+#endif
+        return SEARCH_SCALAR;
+    }
+
+    static search_isa max_isa = detect_search_isa();
+    static search_isa active_isa = max_isa;
+
+    search_isa get_search_isa()
+    {
+        return active_isa;
+    }
+
+    bool set_search_isa(search_isa isa)
+    {
+        if(isa>max_isa)
+            return false;
+        active_isa=isa;
+        return true;
+    }
+
+    /* rank of key among the live slots, eqp is the slot holding key or -1 */
+#ifdef SPLIT_KV
+    static inline int simd_rank(kv_array &entry, permuter perm, uint64_t key, int &eqp)
+    {
+        const u_int64_t *slots = entry.key;
+#else
+    static inline int simd_rank(const kv *entry, permuter perm, uint64_t key, int &eqp)
+    {
+        const u_int64_t *slots = reinterpret_cast<const u_int64_t *>(entry);
+#endif
+        if(active_isa==SEARCH_AVX2)
+            return simd_rank_avx2(slots,perm.value(),key,eqp);
+        return simd_rank_sse42(slots,perm.value(),key,eqp);
+    }
+
+
+    /* Each thread announces the global epoch in its own slot while it is
+       inside an operation, 0 when quiescent. The epoch only moves on when
+       every active thread has caught up, so anything retired at epoch e is
+       unreachable by everyone once the epoch reaches e+2. Retired memory
+       waits in three per-thread lists indexed by epoch%3. */
+    struct epoch_slot {
+        volatile uint64_t   epoch;
+        volatile int        used;
+    } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    struct retired {
+        void    *ptr;
+        void    (*release)(void *);
+    };
+
+    static void release_all(std::vector<retired> &list)
+    {
+        for(size_t i=0; i<list.size(); i++)
+            list[i].release(list[i].ptr);
+        list.clear();
+    }
+
+    static volatile uint64_t    global_epoch=1;
+    static epoch_slot           epoch_slots[EPOCH_THREADS];
+
+    /* retire lists of threads that exited, freed by whoever collects next */
+    static std::vector<retired> orphans;
+    static volatile uint64_t    orphan_epoch=0;
+    static volatile int         orphan_lock=0;
+
+    static void epoch_collect(uint64_t e);
+
+    class epoch_local
+    {
+        public:
+            int                     slot;
+            int                     depth;
+            int                     retires;
+            uint64_t                limbo_epoch[3];
+            std::vector<retired>    limbo[3];
+
+            epoch_local():slot(-1),depth(0),retires(0),limbo_epoch{0,0,0}{}
+            ~epoch_local()
+            {
+                if(slot<0)
+                    return;
+                while(__sync_lock_test_and_set(&orphan_lock,1));
+                for(int i=0; i<3; i++) {
+                    orphans.insert(orphans.end(),limbo[i].begin(),limbo[i].end());
+                    limbo[i].clear();
+                }
+                orphan_epoch=global_epoch;
+                epoch_slots[slot].epoch=0;
+                __sync_lock_release(&epoch_slots[slot].used);
+                /* a thread registering from here on starts after everything
+                   above was unlinked, so the last one out frees it all */
+                for(int i=0; i<EPOCH_THREADS; i++) {
+                    if(epoch_slots[i].used)
+                        goto out;
+                }
+                release_all(orphans);
+                orphan_epoch=0;
+            out:
+                __sync_lock_release(&orphan_lock);
+            }
+    };
+
+    static thread_local epoch_local epoch_self;
+
+    /* slots come back when their thread exits; running out means more
+       than EPOCH_THREADS threads live at once, which would spin forever */
+    static int epoch_register()
+    {
+        for(int i=0; i<EPOCH_THREADS; i++) {
+            if(!epoch_slots[i].used && !__sync_lock_test_and_set(&epoch_slots[i].used,1))
+                return i;
+        }
+        fprintf(stderr,"masstree: more than %d threads use the tree, raise EPOCH_THREADS\n",EPOCH_THREADS);
+        abort();
+    }
+
+    static void epoch_try_advance()
+    {
+        uint64_t e=global_epoch, se;
+        for(int i=0; i<EPOCH_THREADS; i++) {
+            if(!epoch_slots[i].used)
+                continue;
+            se=epoch_slots[i].epoch;
+            if(se && se!=e)
+                return;
+        }
+        __sync_bool_compare_and_swap(&global_epoch,e,e+1);
+    }
+
+    static void epoch_collect(uint64_t e)
+    {
+        epoch_local &self=epoch_self;
+        for(int i=0; i<3; i++) {
+            if(self.limbo_epoch[i]+2<=e)
+                release_all(self.limbo[i]);
+        }
+        /* orphan_epoch is 0 while there are no orphans; it is read unlocked
+           as a hint only, orphans itself is touched under the lock */
+        if(orphan_epoch && orphan_epoch+2<=e && !__sync_lock_test_and_set(&orphan_lock,1)) {
+            if(orphan_epoch && orphan_epoch+2<=e) {
+                if(!orphans.empty())
+                    release_all(orphans);
+                orphan_epoch=0;
+            }
+            __sync_lock_release(&orphan_lock);
+        }
+    }
+
+    void epoch_enter()
+    {
+        epoch_local &self=epoch_self;
+        uint64_t e;
+        if(self.depth++)
+            return;
+        if(self.slot<0)
+            self.slot=epoch_register();
+        do {
+            e=global_epoch;
+            __sync_lock_test_and_set(&epoch_slots[self.slot].epoch,e);
+        } while(e!=global_epoch);
+    }
+
+    void epoch_exit()
+    {
+        epoch_local &self=epoch_self;
+        if(--self.depth)
+            return;
+        fence();
+        epoch_slots[self.slot].epoch=0;
+    }
+
+    void epoch_retire(void *ptr, void (*release)(void *))
+    {
+        epoch_local &self=epoch_self;
+        uint64_t e=global_epoch;
+        int b=e%3;
+        if(self.limbo_epoch[b]!=e) {
+            release_all(self.limbo[b]);
+            self.limbo_epoch[b]=e;
+        }
+        self.limbo[b].push_back({ptr,release});
+        if(++self.retires>=EPOCH_BATCH) {
+            self.retires=0;
+            epoch_try_advance();
+            epoch_collect(global_epoch);
+        }
+    }
+
+    static void release_leaf(void *node)
+    {
+        delete reinterpret_cast<leaf_node *>(node);
     }
 
+    /* an SMO records the node it starts from in the persistent heap before
+       taking its first SMO lock and clears it after releasing the last one,
+       so open() knows what a crash left half done */
+    static void smo_begin(void *node);
+    static void smo_end();
+
     void update_parent(void* node, inner_node* parent) 
     {
         inner_node **value_par;
         value_par = reinterpret_cast<inner_node **>(node);
         *value_par=parent;
+        persist(value_par, sizeof(inner_node *));
+    }
+
+#ifdef STATS
+    /* every thread counts into lines of its own, the tot_*() readers sum
+       the lines and what exited threads folded into stat_exited; the
+       contention events of each operation and the hot levels follow the
+       plain counters */
+    enum { STAT_INSERTS, STAT_LOOKUPS, STAT_SPLITS, STAT_REBALANCES,
+           STAT_NODES, STAT_ENTRIES, STAT_COUNT };
+
+#define STAT_EVENT(op,ev)   (STAT_COUNT+(op)*EV_COUNT+(ev))
+#define STAT_HOT(l)         (STAT_EVENT(OP_COUNT,0)+(l))
+#define STAT_ALL            STAT_HOT(CONTENTION_LEVELS)
+
+    struct stat_slot {
+        volatile int    used;
+        int64_t         n[STAT_ALL];
+    } __attribute__((aligned(CACHE_LINE_SIZE)));
+
+    static stat_slot    stat_slots[EPOCH_THREADS];
+    static int64_t      stat_exited[STAT_ALL];
+
+    class stat_local
+    {
+        public:
+            stat_slot   *slot;
+
+            stat_local():slot(NULL){}
+            ~stat_local()
+            {
+                if(slot==NULL)
+                    return;
+                for(int i=0; i<STAT_ALL; i++) {
+                    __sync_fetch_and_add(&stat_exited[i],slot->n[i]);
+                    slot->n[i]=0;
+                }
+                __sync_lock_release(&slot->used);
+            }
+    };
+
+    static thread_local stat_local stat_self;
+
+    static stat_slot* stat_register()
+    {
+        for(int i=0; i<EPOCH_THREADS; i++) {
+            if(!stat_slots[i].used && !__sync_lock_test_and_set(&stat_slots[i].used,1))
+                return stat_self.slot=&stat_slots[i];
+        }
+        fprintf(stderr,"masstree: more than %d threads keep stats, raise EPOCH_THREADS\n",EPOCH_THREADS);
+        abort();
+    }
+
+    static inline void stat_add(int c, int64_t x)
+    {
+        stat_slot *s=stat_self.slot;
+        if(s==NULL)
+            s=stat_register();
+        s->n[c]+=x;
+    }
+
+    static int64_t stat_sum(int c)
+    {
+        int64_t n=stat_exited[c];
+        for(int i=0; i<EPOCH_THREADS; i++)
+            n+=*(volatile int64_t *)&stat_slots[i].n[c];
+        return n;
+    }
+
+    /* level is the depth below the root the event hit, -1 when unknown;
+       restarts and hops are where a thread went after it, not a hot node */
+    static inline void stat_contended(int op, int ev, int level)
+    {
+        stat_add(STAT_EVENT(op,ev),1);
+        if(level>=0 && ev!=EV_RESTART && ev!=EV_HOP)
+            stat_add(STAT_HOT(level<CONTENTION_LEVELS ? level : CONTENTION_LEVELS-1),1);
     }
 
-    u_int64_t   num_nodes=0;
-    double      space=0;
-    u_int64_t   num_inserts=0;
-    u_int64_t   num_rebalances=0;
-    u_int64_t   num_lookups=0;
+#define STAT_ADD(c,x)               stat_add(c,x)
+#define STAT_CONTENDED(op,ev,l)     stat_contended(op,ev,l)
+#else
+#define STAT_ADD(c,x)
+#define STAT_CONTENDED(op,ev,l)
+#endif
+#define STAT_INC(c)     STAT_ADD(c,1)
+
+    /* lock waiters and descents whose validation keeps failing, mostly on
+       a locked node, wait here before the next try */
+    static inline void backoff(uint &pauses)
+    {
+        if(pauses>BACKOFF_MAX) {
+            sched_yield();
+            return;
+        }
+        for(uint i=0; i<pauses; i++)
+            _mm_pause();
+        pauses<<=1;
+    }
+
+    /* every failed try is one spin for the contention counters */
+    static inline void lock_insert(VersionNumber &v, int op, int level)
+    {
+        uint pauses=1;
+        while(v.tryInsertLock()) {
+            STAT_CONTENDED(op,EV_INSERT_SPIN,level);
+            backoff(pauses);
+        }
+    }
+
+    static inline void lock_smo(VersionNumber &v, int op, int level)
+    {
+        uint pauses=1;
+        while(v.trySMOLock()) {
+            STAT_CONTENDED(op,EV_SMO_SPIN,level);
+            backoff(pauses);
+        }
+    }
 
     int inner_node::size()
     {
@@ -115,6 +679,15 @@ namespace masstree
     key_indexed_position leaf_node::key_lower_bound_by(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return l < LEAF_WIDTH ? key_indexed_position(l,perm[l]) : key_indexed_position(l,-1);
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -133,6 +706,15 @@ namespace masstree
     key_indexed_position leaf_node::key_lower_bound(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return (l-1 < 0 ? key_indexed_position(l-1, -1) : key_indexed_position(l-1, perm[l-1]));
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -152,6 +734,15 @@ namespace masstree
     key_indexed_position inner_node::key_lower_bound_by(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return l < LEAF_WIDTH ? key_indexed_position(l,perm[l]) : key_indexed_position(l,-1);
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -170,6 +761,15 @@ namespace masstree
     key_indexed_position inner_node::key_lower_bound(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return (l-1 < 0 ? key_indexed_position(l-1, -1) : key_indexed_position(l-1, perm[l-1]));
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -196,15 +796,15 @@ namespace masstree
 
         entry[pos].link_or_value=value;
         entry[pos].key=key;
+        persist_entry(entry[pos]);
+        persist_fence();
 
+        /* the permutation store commits the insert */
         permutation = temp.value();
+        persist_header(this);
+        persist_fence();
 
-#ifdef STATS
-        space*=num_nodes;
-        space+=((double)1)/capacity();
-        space/=num_nodes;
-        num_inserts++;
-#endif
+        STAT_INC(STAT_ENTRIES);
 
     }
 
@@ -218,20 +818,99 @@ namespace masstree
 
         entry[pos].link_or_value=value;
         entry[pos].key=key;
+        persist_entry(entry[pos]);
 
+        /* inner nodes are only changed by logged SMOs, which fence before
+           smo_end() and are rebuilt from the leaves when cut short */
         permutation = temp.value();
+        persist_header(this);
 
         update_parent(value, this);
 
-#ifdef STATS
-        space*=num_nodes;
-        space+=((double)1)/capacity();
-        space/=num_nodes;
-        num_inserts++;
-#endif
+        STAT_INC(STAT_ENTRIES);
+
+    }
+
+
+    int leaf_node::remove(u_int64_t key)
+    {
+        permuter temp = permutation.value();
+        key_indexed_position ip = key_lower_bound(key);
+        if(ip.i<0)
+            return 0;
+        if(compare_key(entry[ip.p].key,key)==0)
+        {
+            temp.remove(ip.i);
+            permutation = temp.value();
+            persist_header(this);
+            persist_fence();
+            STAT_ADD(STAT_ENTRIES,-1);
+            if(!IS_IV(entry[ip.p].link_or_value))
+                epoch_retire(entry[ip.p].link_or_value,RRP_free);
+            return 1;
+        }
+        return 0;
+    }
+
+    /* caller holds the insert lock; with expected set the store only goes
+       ahead when the value is still *expected, else *expected gets it */
+    int leaf_node::update(u_int64_t key, void *value, void **expected)
+    {
+        key_indexed_position ip = key_lower_bound(key);
+        if(ip.i<0 || compare_key(entry[ip.p].key,key)!=0)
+            return 0;
+        void *&slot = entry[ip.p].link_or_value;
+        void *old = slot;
+        if(expected && old!=*expected) {
+            *expected = old;
+            return 0;
+        }
+        /* a single aligned word: readers and recovery see the old value or
+           the new one, so neither the version nor the permutation moves */
+        __atomic_store_n(&slot, value, __ATOMIC_RELEASE);
+        persist(&slot, sizeof(void *));
+        persist_fence();
+        if(old!=value && !IS_IV(old))
+            epoch_retire(old,RRP_free);
+        return 1;
+    }
 
+    int inner_node::remove(u_int64_t key)
+    {
+        /* drops the separator equal to key together with the child on its
+           right; child0 is never removed so an inner node never empties */
+        permuter temp = permutation.value();
+        key_indexed_position ip = key_lower_bound(key);
+        if(ip.i<0)
+            return 0;
+        if(compare_key(entry[ip.p].key,key)!=0)
+            return 0;
+        temp.remove(ip.i);
+        permutation = temp.value();
+        persist_header(this);
+        STAT_ADD(STAT_ENTRIES,-1);
+        return 1;
     }
 
+    void leaf_node::del()
+    {
+        /* caller holds both locks here and on left, and the insert lock on
+           the parent; the fences are poisoned so readers still holding this
+           node fail their range checks and restart */
+        left->highkey=highkey;
+        left->right=right;
+        persist_header(left);
+        if(right)
+        {
+            right->left=left;
+            persist_header(right);
+        }
+        /* the chain skips this node before its own link is cut */
+        persist_fence();
+        right=NULL;
+        highkey=0;
+        lowkey=UINT64_MAX;
+    }
 
     inner_node* leaf_node::give_parent()
     {
@@ -299,14 +978,22 @@ namespace masstree
             nr->entry[temp[i]]=entry[temp[i]];
         
         nr->version.trySMOLock();
+        /* nr is durable before the chain reaches it */
+        persist(nr, sizeof(leaf_node));
+        persist_fence();
         
         right=nr;
         highkey=entry[temp[mid]].key;
         if(nr->right)
         {
             nr->right->left=nr;
+            persist_header(nr->right);
         }
         permutation.set_size(mid);
+        /* one line: the new link and the shrunk permutation persist
+           together, and before the released slots are reused */
+        persist_header(this);
+        persist_fence();
 
         if(compare_key(key,highkey)<0)
             insert(key,value);
@@ -347,20 +1034,26 @@ namespace masstree
             nr->entry[temp[i]]=entry[temp[i]];
 
         nr->version.trySMOLock();
+        /* children may point at nr once it is durable */
+        persist(nr, sizeof(inner_node));
+        persist_fence();
 
         right=nr;
         highkey=entry[temp[mid-1]].key;
         if(nr->right)
         {
             nr->right->left=nr;
+            persist_header(nr->right);
         }
         permutation.set_size(mid-1);
+        persist_header(this);
 
         for(int i=mid-1; i<temp.size(); i++)
         {
             inner_node **value_par;
             value_par = reinterpret_cast<inner_node **>(entry[temp[i]].link_or_value);
             *value_par = nr;
+            persist(value_par, sizeof(inner_node *));
         }
 
         int cmp=compare_key(key,highkey);
@@ -369,6 +1062,9 @@ namespace masstree
         else if(cmp>0)
             nr->insert(key,value);
         
+        /* a lock that shows released ends the climb in recover(), so
+           everything it covered is durable before it goes */
+        persist_fence();
         v1->releaseSMOLock();
         v2->releaseSMOLock();
         
@@ -403,9 +1099,12 @@ namespace masstree
             
             while(1) {
                 temp_l=left;
+                uint pauses=1;
                 while(temp_l->version.tryInsertLock()) {
+                    STAT_CONTENDED(OP_INSERT,EV_INSERT_SPIN,-1);
                     if( (temp_l->parent!=parent) || (temp_l->full()) || (temp_l->version.smoLock()) )
                         goto right_sibling;
+                    backoff(pauses);
                 }
                 if(temp_l==left)
                     break;
@@ -417,7 +1116,7 @@ namespace masstree
             }
             while(1) {
                 par=parent;
-                while(par->version.tryInsertLock());
+                lock_insert(par->version,OP_INSERT,-1);
                 if(par==parent)
                     break;
                 par->version.releaseInsertLock();
@@ -434,43 +1133,53 @@ namespace masstree
 
             if(left->size()+to_mov<=mx_sze && to_mov<=ip.i)
             {
-                while(left->version.trySMOLock());
+                lock_smo(left->version,OP_INSERT,-1);
 
                 int base=left->size();
                 permuter temp = left->permutation.value();
                 for(int i=0; i<to_mov; i++)
                 {
                     left->entry[temp[i+base]]=entry[permutation[i]];
+                    persist_entry(left->entry[temp[i+base]]);
                 }
+                persist_fence();
                 temp.set_size(base+to_mov);
                 left->permutation=temp.value();
+                /* left holds the keys before this leaf drops them */
+                persist_header(left);
+                persist_fence();
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(left->highkey);
 
                 if(to_mov==ip.i)
                 {
                     parent->entry[p_upd.p].key=key;
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     temp = permutation.value();
                     temp.rotate(0,to_mov);
                     temp.set_size(temp.size()-to_mov);
                     permutation=temp.value();
+                    persist_header(this);
+                    persist_fence();
 
                     int pos=temp.insert_from_back(0);
                     entry[pos].key=key;
                     entry[pos].link_or_value=value;
+                    persist_entry(entry[pos]);
+                    persist_fence();
                     permutation=temp.value();
 
                     left->highkey=key;
                     lowkey=key;
+                    persist_header(this);
+                    persist_header(left);
+                    persist_fence();
 
-#ifdef STATS
-                    space*=num_nodes;
-                    space+=((double)1)/capacity();
-                    space/=num_nodes;
-#endif
+                    STAT_INC(STAT_ENTRIES);
                 } else {
                     parent->entry[p_upd.p].key=entry[permutation[to_mov]].key;
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     temp = permutation.value();
                     temp.rotate(0,to_mov);
@@ -479,6 +1188,9 @@ namespace masstree
 
                     left->highkey=entry[temp[0]].key;
                     lowkey=entry[temp[0]].key;
+                    persist_header(this);
+                    persist_header(left);
+                    persist_fence();
                     insert(key,value);
                 }
 
@@ -499,9 +1211,12 @@ namespace masstree
             
             while(1) {
                 temp_l=right;
+                uint pauses=1;
                 while(temp_l->version.tryInsertLock()) {
+                    STAT_CONTENDED(OP_INSERT,EV_INSERT_SPIN,-1);
                     if( (temp_l->parent!=parent) || (temp_l->full()) || (temp_l->version.smoLock()) )
                         goto end;
+                    backoff(pauses);
                 }
                 if(temp_l==right)
                     break;
@@ -513,7 +1228,7 @@ namespace masstree
             }
             while(1) {
                 par=parent;
-                while(par->version.tryInsertLock());
+                lock_insert(par->version,OP_INSERT,-1);
                 if(par==parent)
                     break;
                 par->version.releaseInsertLock();
@@ -530,7 +1245,7 @@ namespace masstree
 
             if(right->size()+to_mov<=mx_sze && to_mov<=mx_sze-ip.i)
             {
-                while(right->version.trySMOLock());
+                lock_smo(right->version,OP_INSERT,-1);
 
                 int base=right->size();
                 permuter temp = right->permutation.value();
@@ -539,16 +1254,24 @@ namespace masstree
                 for(int i=0; i<to_mov; i++)
                 {
                     right->entry[temp[i]]=entry[permutation[mx_sze-to_mov+i]];
+                    persist_entry(right->entry[temp[i]]);
                 }
+                persist_fence();
                 right->permutation=temp.value();
+                persist_header(right);
+                persist_fence();
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(highkey);
                 parent->entry[p_upd.p].key=right->entry[temp[0]].key;
+                persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                 permutation.set_size(mx_sze-to_mov);
 
                 highkey=right->entry[temp[0]].key;
                 right->lowkey=right->entry[temp[0]].key;
+                persist_header(this);
+                persist_header(right);
+                persist_fence();
 
                 insert(key,value);
                 
@@ -585,9 +1308,12 @@ namespace masstree
             
             while(1) {
                 temp_i=left;
+                uint pauses=1;
                 while(temp_i->version.tryInsertLock()) {
+                    STAT_CONTENDED(OP_INSERT,EV_INSERT_SPIN,-1);
                     if( (temp_i->parent!=parent) || (temp_i->full()) || (temp_i->version.smoLock()) )
                         goto right_sibling;
+                    backoff(pauses);
                 }
                 if(temp_i==left)
                     break;
@@ -599,7 +1325,7 @@ namespace masstree
             }
             while(1) {
                 par=parent;
-                while(par->version.tryInsertLock());
+                lock_insert(par->version,OP_INSERT,-1);
                 if(par==parent)
                     break;
                 par->version.releaseInsertLock();
@@ -616,7 +1342,7 @@ namespace masstree
 
             if(left->size()+to_mov<=mx_sze && to_mov<=ip.i+1)
             {
-                while(left->version.trySMOLock());
+                lock_smo(left->version,OP_INSERT,-1);
 
                 permuter temp = left->permutation.value();
                 int base=temp.size();
@@ -626,14 +1352,18 @@ namespace masstree
                 for(int i=1; i<to_mov; i++)
                 {
                     left->entry[temp[base+i]]=entry[permutation[i-1]];
+                    persist_entry(left->entry[temp[base+i]]);
                 }
                 left->entry[temp[base]].key=parent->entry[p_upd.p].key;
                 left->entry[temp[base]].link_or_value=child0;
+                persist_entry(left->entry[temp[base]]);
                 left->permutation=temp.value();
+                persist_header(left);
 
                 if(ip.i+1==to_mov)
                 {
                     parent->entry[p_upd.p].key=key;
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     child0=value;
                     {
@@ -644,6 +1374,7 @@ namespace masstree
                     temp.rotate(0,to_mov-1);
                     permutation = temp.value();
 
+                    persist_fence();
                     v1->releaseSMOLock();
                     v2->releaseSMOLock();
 
@@ -655,17 +1386,16 @@ namespace masstree
 
                     left->highkey=parent->entry[p_upd.p].key;
                     lowkey=parent->entry[p_upd.p].key;
+                    persist_header(this);
+                    persist_header(left);
 
-#ifdef STATS
-                    space*=num_nodes;
-                    space+=((double)1)/capacity();
-                    space/=num_nodes;
-#endif
+                    STAT_INC(STAT_ENTRIES);
 
                 } else 
                 {
                     temp = permutation.value();
                     parent->entry[p_upd.p].key=entry[temp[to_mov-1]].key;
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     child0=entry[temp[to_mov-1]].link_or_value;
                     temp.set_size(temp.size()-to_mov);
@@ -680,12 +1410,16 @@ namespace masstree
 
                     left->highkey=parent->entry[p_upd.p].key;
                     lowkey=parent->entry[p_upd.p].key;
+                    persist_header(this);
+                    persist_header(left);
                     insert(key,value);
 
+                    persist_fence();
                     v1->releaseSMOLock();
                     v2->releaseSMOLock();
                 }
 
+                persist_fence();
                 left->version.releaseBothLocks();
                 version.releaseBothLocks();
                 parent->version.incrementInsert();
@@ -702,9 +1436,12 @@ namespace masstree
 
             while(1) {
                 temp_i=right;
+                uint pauses=1;
                 while(temp_i->version.tryInsertLock()) {
+                    STAT_CONTENDED(OP_INSERT,EV_INSERT_SPIN,-1);
                     if( (temp_i->parent!=parent) || (temp_i->full()) || (temp_i->version.smoLock()) )
                         goto end;
+                    backoff(pauses);
                 }
                 if(temp_i==right)
                     break;
@@ -716,7 +1453,7 @@ namespace masstree
             }
             while(1) {
                 par=parent;
-                while(par->version.tryInsertLock());
+                lock_insert(par->version,OP_INSERT,-1);
                 if(par==parent)
                     break;
                 par->version.releaseInsertLock();
@@ -733,7 +1470,7 @@ namespace masstree
 
             if(right->size()+to_mov<=mx_sze && to_mov<mx_sze-ip.i)
             {
-                while(right->version.trySMOLock());
+                lock_smo(right->version,OP_INSERT,-1);
 
                 int base=right->size();
                 permuter temp = right->permutation.value();
@@ -742,14 +1479,17 @@ namespace masstree
                 for(int i=0; i<to_mov-1; i++)
                 {
                     right->entry[temp[i]]=entry[permutation[mx_sze-to_mov+i]];
+                    persist_entry(right->entry[temp[i]]);
                 }
                 right->entry[temp[to_mov-1]].key=highkey;
                 right->entry[temp[to_mov-1]].link_or_value=right->child0;
+                persist_entry(right->entry[temp[to_mov-1]]);
                 right->permutation=temp.value();
                 right->child0=entry[permutation[LEAF_WIDTH-to_mov]].link_or_value;
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(highkey);
                 parent->entry[p_upd.p].key = entry[permutation[LEAF_WIDTH-to_mov]].key;
+                persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                 permutation.set_size(LEAF_WIDTH-to_mov);
 
@@ -760,8 +1500,11 @@ namespace masstree
 
                 highkey=parent->entry[p_upd.p].key;
                 right->lowkey=parent->entry[p_upd.p].key;
+                persist_header(this);
+                persist_header(right);
                 insert(key,value);
 
+                persist_fence();
                 v1->releaseSMOLock();
                 v2->releaseSMOLock();
 
@@ -781,12 +1524,17 @@ namespace masstree
 
     void* btree::get(u_int64_t key)
     {
+        epoch_guard guard;
         void *p;
         inner_node *inner, *temp_i;
         leaf_node *leaf, *temp_l;
         VersionNumber V1, V2;
         key_indexed_position ip;
         bool comp;
+        int depth=0;
+        uint pauses=1;
+
+        STAT_INC(STAT_LOOKUPS);
 
         from_root:
             p=root_;
@@ -801,8 +1549,10 @@ namespace masstree
 
             V2 = get_version(p);
             if( (V1!=inner->version) || (inner->version.insertLock()) ) {
+                STAT_CONTENDED(OP_GET,EV_VALIDATE,depth);
+                backoff(pauses);
                 if(V1.isRoot())
-                    goto from_root;
+                    goto retry;
                 V2=inner->version;
                 if( (V2.smoVersion()!=V1.smoVersion()) || (V2.smoLock()) ) {
                     while(1) {
@@ -817,12 +1567,13 @@ namespace masstree
                     }
                     if(comp) {
                         inner=temp_i;
+                        STAT_CONTENDED(OP_GET,EV_HOP,depth);
                         if(key<inner->highkey) {
                             p=inner;
                             goto from_inner;
                         }
                         else {
-                            goto from_root;
+                            goto retry;
                         }
                     } 
                     else {
@@ -838,9 +1589,10 @@ namespace masstree
                         }
                         if(comp) {
                             inner=temp_i;
+                            STAT_CONTENDED(OP_GET,EV_HOP,depth);
                             ip = inner->key_lower_bound(key);
                             if(ip.i<0)
-                                goto from_root;
+                                goto retry;
                             p=inner;
                             goto from_inner;
                         }
@@ -856,6 +1608,7 @@ namespace masstree
                 goto from_inner;
             }
             V1=V2;
+            depth++;
 
             if(p==NULL)
                 return NULL;
@@ -868,8 +1621,10 @@ namespace masstree
             p = leaf->get(key);
             
             if( (V1!=leaf->version) || (leaf->version.insertLock()) ) {
+                STAT_CONTENDED(OP_GET,EV_VALIDATE,depth);
+                backoff(pauses);
                 if(V1.isRoot())
-                    goto from_root;
+                    goto retry;
                 V2=leaf->version;
                 if( (V2.smoVersion()!=V1.smoVersion()) || (V2.smoLock()) ) {
                     while(1) {
@@ -884,12 +1639,13 @@ namespace masstree
                     }
                     if(comp) {
                         leaf=temp_l;
+                        STAT_CONTENDED(OP_GET,EV_HOP,depth);
                         if(key<leaf->highkey) {
                             p=leaf;
                             goto from_leaf;
                         }
                         else {
-                            goto from_root;
+                            goto retry;
                         }
                     } 
                     else {
@@ -905,13 +1661,16 @@ namespace masstree
                         }
                         if(comp) {
                             leaf=temp_l;
+                            STAT_CONTENDED(OP_GET,EV_HOP,depth);
                             ip = leaf->key_lower_bound(key);
                             if(ip.i<0)
-                                goto from_root;
+                                goto retry;
                             p=leaf;
                             goto from_leaf;
                         }
                         else {
+                            if(leaf->dead() || key<leaf->lowkey)
+                                goto retry;
                             V1=V2;
                             p=leaf;
                             goto from_leaf;
@@ -924,39 +1683,667 @@ namespace masstree
             }
 
             return p;
+
+        retry:
+            STAT_CONTENDED(OP_GET,EV_RESTART,depth);
+            depth=0;
+            goto from_root;
     }
 
-    VersionNumber btree::get_version(void* node) 
+    leaf_node* btree::find_leaf(u_int64_t key)
     {
-        return *reinterpret_cast<VersionNumber *>(reinterpret_cast<u_int64_t>(node)+24);
+        void *p, *child;
+        inner_node *inner;
+        VersionNumber V1;
+
+        /* plain optimistic descent, the caller checks the leaf fences */
+        from_root:
+            p=root_;
+            V1=get_version(p);
+
+            while(!V1.isLeaf()) {
+                inner = reinterpret_cast<inner_node *>(p);
+                child = inner->get(key);
+                if( (V1!=inner->version) || (inner->version.insertLock()) || (child==NULL) )
+                    goto from_root;
+                p=child;
+                V1=get_version(p);
+            }
+            return reinterpret_cast<leaf_node *>(p);
     }
 
-    void btree::new_root()
+    /* the leaf covering key with its insert lock held; only under the lock
+       are its fences stable. the caller is inside an epoch */
+    leaf_node* btree::lock_leaf(u_int64_t key)
     {
-        if(get_version(root_).isLeaf()) {
-            leaf_node* child = new leaf_node(reinterpret_cast<leaf_node*>(root_));
-            child->version.unmarkRoot();
-            inner_node* root = reinterpret_cast<inner_node*>(root_);
-            child->parent=root;
-            root->child0=child;
-            root->version.unmarkLeaf();
-            root->permutation.set_size(0);
-            child->version.releaseBothLocks();
-        }
-        else {
-            inner_node* child = new inner_node(reinterpret_cast<inner_node*>(root_));
-            child->version.unmarkRoot();
-            inner_node* root = reinterpret_cast<inner_node*>(root_);
-            child->parent=root;
-            void* child0 = root->child0;
-            root->child0=child;
-            root->permutation.set_size(0);
-            
+        leaf_node *leaf, *right;
+
+        from_root:
+            leaf=find_leaf(key);
+
+        lock:
+            lock_insert(leaf->version,OP_UPDATE,-1);
+
+            /* a root leaf turns inner in place when the first split grows the tree */
+            if(!leaf->version.isLeaf() || leaf->dead() || key<leaf->lowkey) {
+                leaf->version.releaseInsertLock();
+                STAT_CONTENDED(OP_UPDATE,EV_RESTART,-1);
+                goto from_root;
+            }
+            if(leaf->right && key>=leaf->highkey) {
+                right=leaf->right;
+                leaf->version.releaseInsertLock();
+                leaf=right;
+                STAT_CONTENDED(OP_UPDATE,EV_HOP,-1);
+                goto lock;
+            }
+            return leaf;
+    }
+
+    int btree::upsert(u_int64_t key, void *value)
+    {
+        /* a remove can slip in between, so both are retried */
+        while(1) {
+            if(insert(key,value))
+                return 1;
+            if(update(key,value))
+                return 0;
+        }
+    }
+
+    int btree::update(u_int64_t key, void *value)
+    {
+        epoch_guard guard;
+        leaf_node *leaf=lock_leaf(key);
+        int r=leaf->update(key,value,NULL);
+        leaf->version.releaseInsertLock();
+        return r;
+    }
+
+    int btree::compare_and_swap(u_int64_t key, void *expected, void *desired)
+    {
+        epoch_guard guard;
+        leaf_node *leaf=lock_leaf(key);
+        int r=leaf->update(key,desired,&expected);
+        leaf->version.releaseInsertLock();
+        return r;
+    }
+
+    int btree::scan_leaf(leaf_node* &leaf, u_int64_t &key, u_int64_t *keys, void **values)
+    {
+        VersionNumber V;
+        permuter perm;
+        leaf_node *right;
+        u_int64_t lowkey, highkey, k;
+        int n;
+
+        /* copies the entries >= key of the leaf covering key in key order,
+           then moves key to that leaf's highkey and leaf to its right */
+        if(leaf==NULL)
+            leaf=find_leaf(key);
+
+        snapshot:
+            V=leaf->version;
+            if(V.insertLock()) {
+                _mm_pause();
+                goto snapshot;
+            }
+            perm=leaf->permutation.value();
+            n=0;
+            for(int i=0; i<perm.size(); i++) {
+                k=leaf->entry[perm[i]].key;
+                if(k>=key) {
+                    keys[n]=k;
+                    values[n]=leaf->entry[perm[i]].link_or_value;
+                    n++;
+                }
+            }
+            lowkey=leaf->lowkey;
+            highkey=leaf->highkey;
+            right=leaf->right;
+            if(V!=leaf->version)
+                goto snapshot;
+
+            if(lowkey>highkey || key<lowkey) {
+                leaf=find_leaf(key);
+                goto snapshot;
+            }
+            if(key>=highkey && right) {
+                leaf=right;
+                goto snapshot;
+            }
+
+            key=highkey;
+            leaf=right;
+            return n;
+    }
+
+    int btree::rscan_leaf(leaf_node* &leaf, u_int64_t &key, bool &last, u_int64_t *keys, void **values)
+    {
+        VersionNumber V;
+        permuter perm;
+        leaf_node *left, *right;
+        u_int64_t lowkey, highkey, k;
+        int n;
+
+        /* copies the entries <= key of the leaf covering key in descending
+           order, then moves key below that leaf's lowkey and leaf to its
+           left; a left sibling that split or shrank meanwhile is fixed up
+           by hopping right or further left */
+        if(leaf==NULL)
+            leaf=find_leaf(key);
+
+        snapshot:
+            V=leaf->version;
+            if(V.insertLock()) {
+                _mm_pause();
+                goto snapshot;
+            }
+            perm=leaf->permutation.value();
+            n=0;
+            for(int i=perm.size()-1; i>=0; i--) {
+                k=leaf->entry[perm[i]].key;
+                if(k<=key) {
+                    keys[n]=k;
+                    values[n]=leaf->entry[perm[i]].link_or_value;
+                    n++;
+                }
+            }
+            lowkey=leaf->lowkey;
+            highkey=leaf->highkey;
+            left=leaf->left;
+            right=leaf->right;
+            if(V!=leaf->version)
+                goto snapshot;
+
+            if(lowkey>highkey) {
+                leaf=find_leaf(key);
+                goto snapshot;
+            }
+            if(key>=highkey && right) {
+                leaf=right;
+                goto snapshot;
+            }
+            if(key<lowkey) {
+                leaf = left ? left : find_leaf(key);
+                goto snapshot;
+            }
+
+            last=(lowkey==0);
+            key=lowkey-1;
+            leaf=left;
+            return n;
+    }
+
+    btree::iterator::iterator(btree *tree, u_int64_t start):
+        tree(tree),
+        next_leaf(NULL),
+        next_key(start),
+        last(false),
+        pos(0),
+        size(0)
+    {
+        epoch_enter();
+        fill();
+    }
+
+    btree::iterator::iterator(const iterator &it):
+        tree(it.tree),
+        next_leaf(it.next_leaf),
+        next_key(it.next_key),
+        last(it.last),
+        pos(it.pos),
+        size(it.size)
+    {
+        epoch_enter();
+        memcpy(keys,it.keys,sizeof(keys));
+        memcpy(values,it.values,sizeof(values));
+    }
+
+    btree::iterator::~iterator()
+    {
+        epoch_exit();
+    }
+
+    void btree::iterator::fill()
+    {
+        pos=0;
+        size=0;
+        while(size==0 && !last) {
+            size=tree->scan_leaf(next_leaf,next_key,keys,values);
+            last=(next_key==UINT64_MAX);
+        }
+    }
+
+    btree::iterator &btree::iterator::operator++()
+    {
+        if(++pos>=size)
+            fill();
+        return *this;
+    }
+
+    btree::reverse_iterator::reverse_iterator(btree *tree, u_int64_t start):
+        tree(tree),
+        next_leaf(NULL),
+        next_key(start),
+        last(false),
+        pos(0),
+        size(0)
+    {
+        epoch_enter();
+        fill();
+    }
+
+    btree::reverse_iterator::reverse_iterator(const reverse_iterator &it):
+        tree(it.tree),
+        next_leaf(it.next_leaf),
+        next_key(it.next_key),
+        last(it.last),
+        pos(it.pos),
+        size(it.size)
+    {
+        epoch_enter();
+        memcpy(keys,it.keys,sizeof(keys));
+        memcpy(values,it.values,sizeof(values));
+    }
+
+    btree::reverse_iterator::~reverse_iterator()
+    {
+        epoch_exit();
+    }
+
+    void btree::reverse_iterator::fill()
+    {
+        pos=0;
+        size=0;
+        while(size==0 && !last)
+            size=tree->rscan_leaf(next_leaf,next_key,last,keys,values);
+    }
+
+    btree::reverse_iterator &btree::reverse_iterator::operator++()
+    {
+        if(++pos>=size)
+            fill();
+        return *this;
+    }
+
+    int btree::scan(u_int64_t start, int count, scan_callback callback, void *arg)
+    {
+        int n=0;
+        for(iterator it(this,start); it.valid() && n<count; ++it)
+        {
+            n++;
+            if(!callback(it.key(),it.value(),arg))
+                break;
+        }
+        return n;
+    }
+
+    int btree::rscan(u_int64_t start, int count, scan_callback callback, void *arg)
+    {
+        int n=0;
+        for(reverse_iterator it(this,start); it.valid() && n<count; ++it)
+        {
+            n++;
+            if(!callback(it.key(),it.value(),arg))
+                break;
+        }
+        return n;
+    }
+
+    void btree::multi_get(const u_int64_t *keys, void **out, size_t n)
+    {
+        epoch_guard guard;
+        void *node[MULTI_GET_GROUP], *child;
+        int live[MULTI_GET_GROUP];
+        inner_node *inner;
+        leaf_node *leaf, *right;
+        VersionNumber V;
+        u_int64_t lowkey, highkey;
+        size_t g;
+        int i, m, k;
+
+        /* The group descends one level per round: every lookup picks its
+           child and prefetches it, and the child is only read in the next
+           round once the misses of the whole group overlap. A leaf hit is
+           trusted only when its version is stable and its fences cover the
+           key; anything else falls back to get(). */
+        for(size_t base=0; base<n; base+=MULTI_GET_GROUP) {
+            g = n-base<MULTI_GET_GROUP ? n-base : MULTI_GET_GROUP;
+            for(i=0; i<(int)g; i++) {
+                node[i]=root_;
+                live[i]=i;
+            }
+            m=g;
+
+            while(m>0) {
+                k=0;
+                for(int j=0; j<m; j++) {
+                    i=live[j];
+                    V=get_version(node[i]);
+                    if(V.insertLock()) {
+                        out[base+i]=get(keys[base+i]);
+                        continue;
+                    }
+                    if(V.isLeaf()) {
+                        leaf=reinterpret_cast<leaf_node *>(node[i]);
+                        out[base+i]=leaf->get(keys[base+i]);
+                        lowkey=leaf->lowkey;
+                        highkey=leaf->highkey;
+                        right=leaf->right;
+                        if( (V!=leaf->version) || (lowkey>highkey) || (keys[base+i]<lowkey) ||
+                            (keys[base+i]>=highkey && right) )
+                            out[base+i]=get(keys[base+i]);
+                        else
+                            STAT_INC(STAT_LOOKUPS);
+                        continue;
+                    }
+                    inner=reinterpret_cast<inner_node *>(node[i]);
+                    child=inner->get(keys[base+i]);
+                    if( (V!=inner->version) || (child==NULL) ) {
+                        out[base+i]=get(keys[base+i]);
+                        continue;
+                    }
+                    prefetch_node(child);
+                    node[i]=child;
+                    live[k++]=i;
+                }
+                m=k;
+            }
+        }
+    }
+
+    /* Bulk load: node i of a level that spreads n items over m nodes takes
+       items [i*n/m, (i+1)*n/m), so fences and separators of any node can be
+       computed from its index alone. A node is flushed once, when its parent
+       has been built and nothing in it changes any more. */
+    static inline size_t bulk_first(size_t i, size_t n, size_t m)
+    {
+        return (size_t)((unsigned __int128)i*n/m);
+    }
+
+    static inline void bulk_flush(void *node)
+    {
+        persist(node, sizeof(leaf_node));
+    }
+
+    void btree::bulk_leaves(const u_int64_t *keys, void **values, size_t n, size_t m,
+                            size_t from, size_t to, void **nodes, u_int64_t *lows)
+    {
+        leaf_node *leaf, *prev=NULL;
+        size_t a, b;
+
+        for(size_t i=from; i<to; i++) {
+            a=bulk_first(i,n,m);
+            b=bulk_first(i+1,n,m);
+            leaf = new leaf_node(NULL,NULL,prev);
+            for(size_t j=a; j<b; j++) {
+                leaf->entry[j-a].key=keys[j];
+                leaf->entry[j-a].link_or_value=values[j];
+            }
+            leaf->permutation=permuter::make_sorted(b-a);
+            STAT_ADD(STAT_ENTRIES,b-a);
+            leaf->lowkey = i ? keys[a] : 0;
+            leaf->highkey = i+1<m ? keys[b] : UINT64_MAX;
+            if(prev)
+                prev->right=leaf;
+            nodes[i]=leaf;
+            lows[i]=leaf->lowkey;
+            prev=leaf;
+        }
+    }
+
+    void btree::bulk_inners(void **children, const u_int64_t *lows, size_t n, size_t m,
+                            size_t from, size_t to, void **nodes, u_int64_t *nlows)
+    {
+        inner_node *inner, *prev=NULL;
+        size_t a, b;
+
+        for(size_t i=from; i<to; i++) {
+            a=bulk_first(i,n,m);
+            b=bulk_first(i+1,n,m);
+            inner = new inner_node(NULL,NULL,prev);
+            inner->child0=children[a];
+            update_parent(children[a],inner);
+            bulk_flush(children[a]);
+            for(size_t j=a+1; j<b; j++) {
+                inner->entry[j-a-1].key=lows[j];
+                inner->entry[j-a-1].link_or_value=children[j];
+                update_parent(children[j],inner);
+                bulk_flush(children[j]);
+            }
+            inner->permutation=permuter::make_sorted(b-a-1);
+            STAT_ADD(STAT_ENTRIES,b-a-1);
+            inner->lowkey = i ? lows[a] : 0;
+            inner->highkey = i+1<m ? lows[b] : UINT64_MAX;
+            if(prev)
+                prev->right=inner;
+            nodes[i]=inner;
+            nlows[i]=inner->lowkey;
+            prev=inner;
+        }
+    }
+
+    /* one level of a bulk load, items are keys/values for the leaf level
+       and children/lows above it; [from,to) is the slice of one worker */
+    struct bulk_task {
+        btree           *tree;
+        const u_int64_t *keys;
+        void            **values;
+        const u_int64_t *lows;
+        size_t          n,
+                        m,
+                        from,
+                        to;
+        void            **nodes;
+        u_int64_t       *nlows;
+    };
+
+    void* btree::bulk_worker(void *arg)
+    {
+        bulk_task *t = reinterpret_cast<bulk_task *>(arg);
+        if(t->keys)
+            t->tree->bulk_leaves(t->keys,t->values,t->n,t->m,t->from,t->to,t->nodes,t->nlows);
+        else
+            t->tree->bulk_inners(t->values,t->lows,t->n,t->m,t->from,t->to,t->nodes,t->nlows);
+        /* a worker writes back its own lines */
+        persist_fence();
+        return NULL;
+    }
+
+    void btree::bulk_level(bulk_task *task, int threads)
+    {
+        bulk_task *part;
+        pthread_t *thr;
+        bool *spawned;
+        size_t m = task->m;
+
+        if((size_t)threads>m/BULK_MIN_NODES)
+            threads = m/BULK_MIN_NODES;
+        if(threads<=1) {
+            task->from=0;
+            task->to=m;
+            bulk_worker(task);
+            return;
+        }
+
+        part = new bulk_task[threads];
+        thr = new pthread_t[threads];
+        spawned = new bool[threads];
+
+        for(int i=0; i<threads; i++) {
+            part[i]=*task;
+            part[i].from=bulk_first(i,m,threads);
+            part[i].to=bulk_first(i+1,m,threads);
+            spawned[i]=false;
+            if(!i)
+                continue;
+            /* out of threads, build the slice here instead */
+            if(pthread_create(&thr[i], NULL, bulk_worker, &part[i]))
+                bulk_worker(&part[i]);
+            else
+                spawned[i]=true;
+        }
+        bulk_worker(&part[0]);
+        for(int i=1; i<threads; i++)
+            if(spawned[i])
+                pthread_join(thr[i], NULL);
+
+        /* every slice starts without a left neighbour, stitch the seams */
+        for(int i=1; i<threads; i++) {
+            size_t at=part[i].from;
+            if(task->keys) {
+                reinterpret_cast<leaf_node *>(task->nodes[at-1])->right=reinterpret_cast<leaf_node *>(task->nodes[at]);
+                reinterpret_cast<leaf_node *>(task->nodes[at])->left=reinterpret_cast<leaf_node *>(task->nodes[at-1]);
+            } else {
+                reinterpret_cast<inner_node *>(task->nodes[at-1])->right=reinterpret_cast<inner_node *>(task->nodes[at]);
+                reinterpret_cast<inner_node *>(task->nodes[at])->left=reinterpret_cast<inner_node *>(task->nodes[at-1]);
+            }
+        }
+        delete[] part;
+        delete[] thr;
+        delete[] spawned;
+    }
+
+    int btree::bulk_load(const u_int64_t *keys, void **values, size_t n, double fill_factor, int threads)
+    {
+        epoch_guard guard;
+        leaf_node *leaf = reinterpret_cast<leaf_node *>(root_);
+        inner_node *root = reinterpret_cast<inner_node *>(root_);
+        void **nodes, **children;
+        u_int64_t *lows, *clows;
+        size_t m, cn;
+        int leaf_fill, inner_fill;
+        bulk_task task;
+
+        for(size_t i=1; i<n; i++) {
+            if(keys[i-1]>=keys[i])
+                return 0;
+        }
+        if(fill_factor>1)
+            fill_factor=1;
+        leaf_fill = (int)(fill_factor*LEAF_WIDTH+0.5);
+        leaf_fill = leaf_fill<1 ? 1 : leaf_fill;
+        inner_fill = (int)(fill_factor*(LEAF_WIDTH+1)+0.5);
+        inner_fill = inner_fill<2 ? 2 : inner_fill;
+
+        /* only an empty tree can be loaded; the root keeps its address and
+           stays locked until it takes over the top level */
+        smo_begin(leaf);
+        lock_smo(leaf->version,OP_INSERT,0);
+        if(!leaf->version.isLeaf() || !leaf->empty()) {
+            leaf->version.releaseBothLocks();
+            smo_end();
+            return 0;
+        }
+
+        if(n<=(size_t)LEAF_WIDTH) {
+            for(size_t j=0; j<n; j++) {
+                leaf->entry[j].key=keys[j];
+                leaf->entry[j].link_or_value=values[j];
+            }
+            leaf->permutation=permuter::make_sorted(n);
+            STAT_ADD(STAT_ENTRIES,n);
+            bulk_flush(leaf);
+            persist_fence();
+            leaf->version.releaseBothLocks();
+            smo_end();
+            return 1;
+        }
+
+        cn=(n+leaf_fill-1)/leaf_fill;
+        children=new void*[cn];
+        clows=new u_int64_t[cn];
+        task={this,keys,values,NULL,n,cn,0,cn,children,clows};
+        bulk_level(&task,threads);
+
+        while(cn>(size_t)inner_fill) {
+            m=(cn+inner_fill-1)/inner_fill;
+            nodes=new void*[m];
+            lows=new u_int64_t[m];
+            task={this,NULL,children,clows,cn,m,0,m,nodes,lows};
+            bulk_level(&task,threads);
+            delete[] children;
+            delete[] clows;
+            children=nodes;
+            clows=lows;
+            cn=m;
+        }
+
+        root->child0=children[0];
+        update_parent(children[0],root);
+        bulk_flush(children[0]);
+        for(size_t j=1; j<cn; j++) {
+            root->entry[j-1].key=clows[j];
+            root->entry[j-1].link_or_value=children[j];
+            update_parent(children[j],root);
+            bulk_flush(children[j]);
+        }
+        delete[] children;
+        delete[] clows;
+        persist_fence();
+
+        /* turned into an inner node first: a crash in between leaves a root
+           whose child0 reaches the whole leaf chain, which recovery rebuilds */
+        root->version.unmarkLeaf();
+        root->permutation=permuter::make_sorted(cn-1);
+        STAT_ADD(STAT_ENTRIES,cn-1);
+        bulk_flush(root);
+        persist_fence();
+        root->version.releaseBothLocks();
+        smo_end();
+        return 1;
+    }
+
+    VersionNumber btree::get_version(void* node) 
+    {
+        /* the version is read without knowing the node type, and insert()
+           finds child0 of a root that was a leaf through dummy */
+        static_assert(offsetof(leaf_node,version)==offsetof(inner_node,version), "version must share its offset");
+        static_assert(offsetof(leaf_node,dummy)==offsetof(inner_node,child0), "dummy must overlay child0");
+        /* persist_header() relies on one line holding the whole header */
+        static_assert(offsetof(inner_node,child0)+sizeof(void *)<=CACHE_LINE_SIZE, "inner header spans cache lines");
+        static_assert(NODE_ALIGN%CACHE_LINE_SIZE==0, "nodes must start on a cache line");
+        return *reinterpret_cast<VersionNumber *>(reinterpret_cast<char *>(node)+offsetof(leaf_node,version));
+    }
+
+    void btree::new_root()
+    {
+        if(get_version(root_).isLeaf()) {
+            leaf_node* child = new leaf_node(reinterpret_cast<leaf_node*>(root_));
+            child->version.unmarkRoot();
+            inner_node* root = reinterpret_cast<inner_node*>(root_);
+            child->parent=root;
+            persist(child, sizeof(leaf_node));
+            persist_fence();
+            /* the root turns inner in a single line */
+            root->child0=child;
+            root->version.unmarkLeaf();
+            root->permutation.set_size(0);
+            persist_header(root);
+            persist_fence();
+            child->version.releaseBothLocks();
+            persist_header(child);
+        }
+        else {
+            inner_node* child = new inner_node(reinterpret_cast<inner_node*>(root_));
+            child->version.unmarkRoot();
+            inner_node* root = reinterpret_cast<inner_node*>(root_);
+            child->parent=root;
+            persist(child, sizeof(inner_node));
+            persist_fence();
+            void* child0 = root->child0;
+            root->child0=child;
+            root->permutation.set_size(0);
+            persist_header(root);
+            
             update_parent(child0, child);
             for(int i=0; i<LEAF_WIDTH; i++) {
                 update_parent(root->entry[i].link_or_value, child);
             }
+            persist_fence();
             child->version.releaseBothLocks();
+            persist_header(child);
         }
     }
 
@@ -965,19 +2352,24 @@ namespace masstree
         leaf_node *nroot;
         nroot = new leaf_node;
         nroot->version.markRoot();
+        persist(nroot, sizeof(leaf_node));
+        persist_fence();
         root_ = reinterpret_cast<void *>(nroot);
     }
 
-    int btree::insert(u_int64_t key, void* value)
+    int btree::insert(u_int64_t key, void* value, rmw_callback callback, void *arg)
     {
+        epoch_guard guard;
         kv to_insert;
-        void *p;
+        void *p, *old;
         inner_node *inner, *temp_i;
         leaf_node *leaf, *temp_l;
         VersionNumber V1, V2;
         VersionNumber *cv1, *cv2;
         key_indexed_position ip;
         bool comp;
+        int depth=0;
+        uint pauses=1;
 
         from_root:
             p=root_;
@@ -994,8 +2386,10 @@ namespace masstree
 
             V2 = get_version(p);
             if( (V1!=inner->version) || (inner->version.insertLock()) ) {
+                STAT_CONTENDED(OP_INSERT,EV_VALIDATE,depth);
+                backoff(pauses);
                 if(V1.isRoot())
-                    goto from_root;
+                    goto retry;
                 V2=inner->version;
                 if( (V2.smoVersion()!=V1.smoVersion()) || (V2.smoLock()) ) {
                     while(1) {
@@ -1010,12 +2404,13 @@ namespace masstree
                     }
                     if(comp) {
                         inner=temp_i;
+                        STAT_CONTENDED(OP_INSERT,EV_HOP,depth);
                         if(key<inner->highkey) {
                             p=inner;
                             goto find;
                         }
                         else {
-                            goto from_root;
+                            goto retry;
                         }
                     } 
                     else {
@@ -1031,9 +2426,10 @@ namespace masstree
                         }
                         if(comp) {
                             inner=temp_i;
+                            STAT_CONTENDED(OP_INSERT,EV_HOP,depth);
                             ip = inner->key_lower_bound(key);
                             if(ip.i<0)
-                                goto from_root;
+                                goto retry;
                             p=inner;
                             goto find;
                         }
@@ -1049,6 +2445,7 @@ namespace masstree
                 goto find;
             }
             V1=V2;
+            depth++;
 
             if(p==NULL)
                 return 0;
@@ -1060,25 +2457,26 @@ namespace masstree
             goto find;
 
         leaf_insert:
-            if(leaf->get(key))
+            if(callback==NULL && leaf->get(key))
                 return 0;
 
-            while(leaf->version.tryInsertLock());
+            lock_insert(leaf->version,OP_INSERT,depth);
 
             if(V1.isRoot() && V1.insertVersion()!=leaf->version.insertVersion()) {
                 leaf->version.releaseInsertLock();
-                goto from_root;
+                goto retry;
             }
             if(leaf->right && key>=leaf->highkey) {
                 V1=leaf->right->version;
                 leaf=leaf->right;
+                STAT_CONTENDED(OP_INSERT,EV_HOP,depth);
                 if(key<leaf->highkey) {
                     leaf->left->version.releaseInsertLock();
                     goto leaf_insert;
                 }
                 else {
                     leaf->left->version.releaseInsertLock();
-                    goto from_root;
+                    goto retry;
                 }
             } 
             else {
@@ -1096,40 +2494,68 @@ namespace masstree
                     ip = temp_l->key_lower_bound(key);
                     leaf->version.releaseInsertLock();
                     if(ip.i<0)
-                        goto from_root;
+                        goto retry;
                     leaf=temp_l;
+                    STAT_CONTENDED(OP_INSERT,EV_HOP,depth);
                     goto leaf_insert;
                 }
             }
+            if(leaf->dead() || key<leaf->lowkey) {
+                leaf->version.releaseInsertLock();
+                goto retry;
+            }
+            /* the check above ran unlocked, two inserts of one key can both pass it */
+            if((old=leaf->get(key))) {
+                if(callback)
+                    leaf->update(key,callback(old,arg),NULL);
+                leaf->version.releaseInsertLock();
+                return 0;
+            }
 
             if(leaf->full())
             {
                 if(leaf->version.isRoot())
                 {
                     //std::cout<<"leaf root full\n";
+                    smo_begin(leaf);
                     leaf->version.trySMOLock();
                     new_root();
                     leaf->version.releaseBothLocks();
+                    smo_end();
                     leaf = reinterpret_cast<leaf_node *>(reinterpret_cast<void *>(leaf->dummy));
                     goto leaf_insert;
                 } else 
                 {
-                    while(leaf->version.trySMOLock());
-
-                    if(leaf->rebalance(key,value))
+                    /* the root case above comes back here, so the
+                       callback only runs once the insert is certain */
+                    if(callback)
+                        value=callback(NULL,arg);
+                    STAT_INC(STAT_INSERTS);
+                    smo_begin(leaf);
+                    lock_smo(leaf->version,OP_INSERT,depth);
+
+                    if(leaf->rebalance(key,value)) {
+                        STAT_INC(STAT_REBALANCES);
+                        smo_end();
                         return 1;
+                    }
                     //printf("trying leaf split\n");
+                    STAT_INC(STAT_SPLITS);
                     to_insert = leaf->split(key,value,cv1,cv2);
                     key = to_insert.key;
                     value = to_insert.link_or_value;
                     p = leaf;
                     inner = leaf->parent;
+                    depth--;
                     goto inner_insert;
                 }
             } else 
             {
+                if(callback)
+                    value=callback(NULL,arg);
+                STAT_INC(STAT_INSERTS);
                 leaf->insert(key,value);
-                leaf->version.insertVersion();
+                leaf->version.incrementInsert();
                 leaf->version.releaseInsertLock();
                 return 1;
             }
@@ -1137,7 +2563,7 @@ namespace masstree
         inner_insert:
 
             while(1) {
-                while(inner->version.tryInsertLock());
+                lock_insert(inner->version,OP_INSERT,depth);
                 if(inner==*reinterpret_cast<inner_node **>(p))
                     break;
                 inner->version.releaseInsertLock();
@@ -1155,106 +2581,1125 @@ namespace masstree
                     goto inner_insert;
                 } else 
                 {
-                    while(inner->version.trySMOLock());
-
-                    if(inner->rebalance(key,value,cv1,cv2))
+                    lock_smo(inner->version,OP_INSERT,depth);
+                    /* recovery climbs from the logged leaf through nodes
+                       holding stale locks, so this one must show before
+                       anything above it changes */
+                    persist_header(inner);
+                    persist_fence();
+
+                    if(inner->rebalance(key,value,cv1,cv2)) {
+                        STAT_INC(STAT_REBALANCES);
+                        smo_end();
                         return 1;
+                    }
 
-                    
+                    STAT_INC(STAT_SPLITS);
                     to_insert = inner->split(key,value,cv1,cv2);
                     
                     key=to_insert.key;
                     value=to_insert.link_or_value;
                     p = inner;
                     inner = inner->parent;
+                    depth--;
                     goto inner_insert;
                 }
             } else 
             {
                 
                 inner->insert(key,value);
+                persist_fence();
                 cv1->releaseSMOLock();
                 cv2->releaseSMOLock();
                 inner->version.incrementInsert();
                 inner->version.releaseInsertLock();
+                smo_end();
                 return 1;
             }
-    }
-
-    void* btree::operator new(size_t size)
-    {
-        void *ptr = RRP_malloc(size);
-        memset(ptr,0,size);
-
-        return ptr;
-    }
-
-    void btree::operator delete(void *addr)
-    {
-        RRP_free(addr);
-    }
 
-    void* leaf_node::operator new(size_t size)
-    {
-        void *ptr = RRP_malloc(size);
-        memset(ptr,0,size);
-
-#ifdef STATS
-        space*=num_nodes;
-        num_nodes++;
-        space/=num_nodes;
-#endif
-
-        return ptr;
-    }
-
-    void leaf_node::operator delete(void *addr)
-    {
-        RRP_free(addr);
-    }
-
-    void* inner_node::operator new(size_t size)
-    {
-        void *ptr = RRP_malloc(size);
-        memset(ptr,0,size);
-
-#ifdef STATS
-        space*=num_nodes;
-        num_nodes++;
-        space/=num_nodes;
-#endif
-
-        return ptr;
-    }
-
-    void inner_node::operator delete(void *addr)
-    {
-        RRP_free(addr);
-    }
-
-    u_int64_t btree::tot_nodes()
-    {
-        return num_nodes;
+        retry:
+            STAT_CONTENDED(OP_INSERT,EV_RESTART,depth);
+            depth=0;
+            goto from_root;
     }
 
-    u_int64_t btree::tot_lookups()
+    void btree::remove(u_int64_t key)
     {
-        return num_lookups;
-    }
+        epoch_guard guard;
+        void *p;
+        inner_node *inner, *temp_i, *par;
+        leaf_node *leaf, *temp_l;
+        VersionNumber V1, V2;
+        key_indexed_position ip;
+        bool comp;
+        int depth=0;
+        uint pauses=1;
 
-    u_int64_t btree::tot_inserts()
-    {
-        return num_inserts;
-    }
+        from_root:
+            p=root_;
+            V1 = get_version(p);
+            if(V1.isLeaf())
+            {
+                leaf = reinterpret_cast<leaf_node *>(p);
+                goto leaf_delete;
+            }
 
-    u_int64_t btree::tot_rebalances()
-    {
-        return num_rebalances;
-    }
+        find:
+            inner = reinterpret_cast<inner_node *>(p);
+            p = inner->get(key);
 
-    double btree::efficiency()
+            V2 = get_version(p);
+            if( (V1!=inner->version) || (inner->version.insertLock()) ) {
+                STAT_CONTENDED(OP_REMOVE,EV_VALIDATE,depth);
+                backoff(pauses);
+                if(V1.isRoot())
+                    goto retry;
+                V2=inner->version;
+                if( (V2.smoVersion()!=V1.smoVersion()) || (V2.smoLock()) ) {
+                    while(1) {
+                        temp_i=inner->right;
+                        comp=temp_i;
+                        if(comp) {
+                            V1=temp_i->version;
+                            comp=(key>=inner->highkey);
+                        }
+                        if(temp_i==inner->right)
+                            break;
+                    }
+                    if(comp) {
+                        inner=temp_i;
+                        STAT_CONTENDED(OP_REMOVE,EV_HOP,depth);
+                        if(key<inner->highkey) {
+                            p=inner;
+                            goto find;
+                        }
+                        else {
+                            goto retry;
+                        }
+                    } 
+                    else {
+                        while(1) {
+                            temp_i=inner->left;
+                            comp=temp_i;
+                            if(comp) {
+                                V1=temp_i->version;
+                                comp=(key<temp_i->highkey);
+                            }
+                            if(temp_i==inner->left)
+                                break;
+                        }
+                        if(comp) {
+                            inner=temp_i;
+                            STAT_CONTENDED(OP_REMOVE,EV_HOP,depth);
+                            ip = inner->key_lower_bound(key);
+                            if(ip.i<0)
+                                goto retry;
+                            p=inner;
+                            goto find;
+                        }
+                        else {
+                            V1=V2;
+                            p=inner;
+                            goto find;
+                        }
+                    }
+                }
+                p=inner;
+                V1=V2;
+                goto find;
+            }
+            V1=V2;
+            depth++;
+
+            if(p==NULL)
+                return;
+            if( V1.isLeaf() )
+            {
+                leaf = reinterpret_cast<leaf_node *>(p);
+                goto leaf_delete;
+            }
+            goto find;
+
+        leaf_delete:
+            lock_insert(leaf->version,OP_REMOVE,depth);
+
+            if(V1.isRoot() && V1.insertVersion()!=leaf->version.insertVersion()) {
+                leaf->version.releaseInsertLock();
+                goto retry;
+            }
+            if(leaf->right && key>=leaf->highkey) {
+                V1=leaf->right->version;
+                leaf=leaf->right;
+                STAT_CONTENDED(OP_REMOVE,EV_HOP,depth);
+                if(key<leaf->highkey) {
+                    leaf->left->version.releaseInsertLock();
+                    goto leaf_delete;
+                }
+                else {
+                    leaf->left->version.releaseInsertLock();
+                    goto retry;
+                }
+            } 
+            else {
+                while(1) {
+                    temp_l=leaf->left;
+                    comp=temp_l;
+                    if(comp) {
+                        V1=temp_l->version;
+                        comp=(key<temp_l->highkey);
+                    }
+                    if(temp_l==leaf->left)
+                        break;
+                }
+                if(comp) {
+                    ip = temp_l->key_lower_bound(key);
+                    leaf->version.releaseInsertLock();
+                    if(ip.i<0)
+                        goto retry;
+                    leaf=temp_l;
+                    STAT_CONTENDED(OP_REMOVE,EV_HOP,depth);
+                    goto leaf_delete;
+                }
+            }
+            if(leaf->dead() || key<leaf->lowkey) {
+                leaf->version.releaseInsertLock();
+                goto retry;
+            }
+
+            if(!leaf->remove(key)) {
+                leaf->version.releaseInsertLock();
+                return;
+            }
+            leaf->version.incrementInsert();
+            if(!leaf->empty() || leaf->version.isRoot()) {
+                leaf->version.releaseInsertLock();
+                return;
+            }
+
+            /* the leaf is empty: fold its range into the left sibling when
+               both share a parent, otherwise keep it around for later inserts */
+            smo_begin(leaf);
+            lock_smo(leaf->version,OP_REMOVE,depth);
+            if(leaf->left==NULL)
+                goto end;
+
+            while(1) {
+                temp_l=leaf->left;
+                uint lock_pauses=1;
+                while(temp_l->version.tryInsertLock()) {
+                    STAT_CONTENDED(OP_REMOVE,EV_INSERT_SPIN,depth);
+                    if( (temp_l->parent!=leaf->parent) || (temp_l->version.smoLock()) )
+                        goto end;
+                    backoff(lock_pauses);
+                }
+                if(temp_l==leaf->left)
+                    break;
+                temp_l->version.releaseInsertLock();
+            }
+            if( (temp_l->parent!=leaf->parent) || (temp_l->version.smoLock()) ) {
+                temp_l->version.releaseInsertLock();
+                goto end;
+            }
+            lock_smo(temp_l->version,OP_REMOVE,depth);
+
+            while(1) {
+                par=leaf->parent;
+                lock_insert(par->version,OP_REMOVE,depth);
+                if(par==leaf->parent)
+                    break;
+                par->version.releaseInsertLock();
+            }
+            if( (temp_l->parent!=par) || (par->get(leaf->lowkey)!=leaf) ) {
+                temp_l->version.releaseBothLocks();
+                par->version.releaseInsertLock();
+                goto end;
+            }
+
+            par->remove(leaf->lowkey);
+            leaf->del();
+            persist_fence();
+
+            leaf->version.releaseBothLocks();
+            temp_l->version.releaseBothLocks();
+            par->version.incrementInsert();
+            par->version.releaseInsertLock();
+            epoch_retire(leaf,release_leaf);
+            smo_end();
+            return;
+
+        end:
+            leaf->version.releaseBothLocks();
+            smo_end();
+            return;
+
+        retry:
+            STAT_CONTENDED(OP_REMOVE,EV_RESTART,depth);
+            depth=0;
+            goto from_root;
+    }
+
+    /* Built-in persistent heap for builds without DRAM or RALLOC: a single
+       file mmap'd at a fixed address, so pointers stored in it stay valid
+       from one run to the next. Small blocks come in power of two classes
+       from 32B to PHEAP_SMALL, larger ones are page rounded and reused
+       first fit. Every block starts with a 16B header holding its size and,
+       while free, the next free block. Metadata updates are flushed as they
+       are made; pheap_sync() msyncs the used part of the file. A crash can
+       leak blocks but never hands out one in use. The node pool's chunks
+       hang off chunks, so open() can find the free slots of an earlier
+       run again. */
+    struct pheap_header {
+        u_int64_t   magic;
+        u_int64_t   size;
+        u_int64_t   base;
+        u_int64_t   top;
+        void        *root;
+        char        *large;
+        char        *free_list[PHEAP_CLASSES];
+        u_int64_t   lock_version;
+        void        *smo_log[EPOCH_THREADS];
+        char        *chunks;
+    };
+
+    struct pheap_block {
+        u_int64_t   size;
+        char        *next;
+    };
+
+    #define PHEAP_MAGIC     0x4d41535354524545ULL
+    #define PHEAP_SMALL     (32ULL<<(PHEAP_CLASSES-1))
+
+    static pheap_header     *pheap=NULL;
+    static char             *pheap_path=NULL;
+    /* pool chunks carved before this process mapped the heap */
+    static char             *pheap_old=NULL;
+    static volatile int     pheap_lock=0;
+
+    static inline void pheap_persist(void *p, int len)
+    {
+        persist(p,len);
+        persist_fence();
+    }
+
+    static inline bool pheap_zero(const pheap_header *h)
+    {
+        const char *c=reinterpret_cast<const char *>(h);
+        for(size_t i=0; i<sizeof(pheap_header); i++)
+            if(c[i])
+                return false;
+        return true;
+    }
+
+    /* maps the heap in path, formatting it when the file is new, empty or
+       was never formatted (no magic, header still zero); a process holds
+       one heap, later calls fail unless they name the same file */
+    static int pheap_map(const char *path)
+    {
+        pheap_header h;
+        struct stat st;
+        void *addr;
+        char *real;
+        int fd, fresh;
+
+        if(pheap) {
+            real=realpath(path,NULL);
+            fresh=(real && !strcmp(real,pheap_path));
+            free(real);
+            return fresh ? 0 : -1;
+        }
+        fd=::open(path,O_RDWR|O_CREAT,0644);
+        if(fd<0)
+            return -1;
+        if(fstat(fd,&st))
+            goto fail;
+        fresh=(st.st_size==0);
+        if(!fresh) {
+            if(pread(fd,&h,sizeof(h),0)!=sizeof(h))
+                goto fail;
+            if(h.magic!=PHEAP_MAGIC) {
+                if(!pheap_zero(&h))
+                    goto fail;
+                fresh=1;
+            }
+        }
+        if(fresh) {
+            h.size=PHEAP_SIZE;
+            h.base=PHEAP_BASE;
+            if(st.st_size<(off_t)h.size && ftruncate(fd,h.size))
+                goto fail;
+        }
+        pheap_path=realpath(path,NULL);
+        if(!pheap_path)
+            goto fail;
+
+        addr=mmap(reinterpret_cast<void *>(h.base),h.size,PROT_READ|PROT_WRITE,
+                  MAP_SHARED|MAP_FIXED_NOREPLACE,fd,0);
+        if(addr==MAP_FAILED)
+            goto unpath;
+        /* kernels before 4.17 take the address as a hint only */
+        if(addr!=reinterpret_cast<void *>(h.base)) {
+            munmap(addr,h.size);
+            goto unpath;
+        }
+        close(fd);
+
+        pheap=reinterpret_cast<pheap_header *>(addr);
+        if(fresh) {
+            pheap->size=h.size;
+            pheap->base=h.base;
+            pheap->top=(sizeof(pheap_header)+NODE_ALIGN-1)&~(u_int64_t)(NODE_ALIGN-1);
+            pheap->lock_version=lock_version;
+            pheap_persist(pheap,sizeof(pheap_header));
+            pheap->magic=PHEAP_MAGIC;
+            pheap_persist(&pheap->magic,sizeof(u_int64_t));
+        }
+        pheap_old=pheap->chunks;
+        return 0;
+
+    unpath:
+        free(pheap_path);
+        pheap_path=NULL;
+    fail:
+        close(fd);
+        return -1;
+    }
+
+    void* pheap_malloc(size_t size)
+    {
+        pheap_block *b, *prev;
+        char **head;
+        u_int64_t bs;
+        int c=0;
+
+        while((32ULL<<c)<size+sizeof(pheap_block) && c<PHEAP_CLASSES)
+            c++;
+        if(c<PHEAP_CLASSES)
+            bs=32ULL<<c;
+        else
+            bs=(size+sizeof(pheap_block)+4095)&~4095ULL;
+
+        while(__sync_lock_test_and_set(&pheap_lock,1));
+        if(!pheap && pheap_map(PHEAP_FILE))
+            goto fail;
+
+        if(c<PHEAP_CLASSES) {
+            head=&pheap->free_list[c];
+            if(*head)
+                goto pop;
+        }
+        else {
+            prev=NULL;
+            for(head=&pheap->large; *head; head=&prev->next) {
+                if(reinterpret_cast<pheap_block *>(*head)->size>=bs)
+                    goto pop;
+                prev=reinterpret_cast<pheap_block *>(*head);
+            }
+        }
+
+        if(pheap->top+bs>pheap->size)
+            goto fail;
+        b=reinterpret_cast<pheap_block *>(pheap->base+pheap->top);
+        b->size=bs;
+        b->next=NULL;
+        pheap_persist(b,sizeof(pheap_block));
+        pheap->top+=bs;
+        pheap_persist(&pheap->top,sizeof(u_int64_t));
+        goto out;
+
+    pop:
+        b=reinterpret_cast<pheap_block *>(*head);
+        *head=b->next;
+        pheap_persist(head,sizeof(char *));
+    out:
+        __sync_lock_release(&pheap_lock);
+        return b+1;
+
+    fail:
+        __sync_lock_release(&pheap_lock);
+        return NULL;
+    }
+
+    void pheap_free(void *ptr)
+    {
+        pheap_block *b;
+        char **head;
+        int c=0;
+
+        if(!ptr)
+            return;
+        b=reinterpret_cast<pheap_block *>(ptr)-1;
+        while(c<PHEAP_CLASSES && (32ULL<<c)!=b->size)
+            c++;
+        head=(c<PHEAP_CLASSES)?&pheap->free_list[c]:&pheap->large;
+
+        while(__sync_lock_test_and_set(&pheap_lock,1));
+        b->next=*head;
+        pheap_persist(&b->next,sizeof(char *));
+        *head=reinterpret_cast<char *>(b);
+        pheap_persist(head,sizeof(char *));
+        __sync_lock_release(&pheap_lock);
+    }
+
+    void pheap_sync()
+    {
+        if(pheap)
+            msync(pheap,(pheap->top+4095)&~4095ULL,MS_SYNC);
+    }
+
+    u_int64_t pheap_used()
+    {
+        return pheap ? pheap->top : 0;
+    }
+
+    static void smo_begin(void *node)
+    {
+        if(!pheap)
+            return;
+        pheap->smo_log[epoch_self.slot]=node;
+        pheap_persist(&pheap->smo_log[epoch_self.slot],sizeof(void *));
+    }
+
+    static void smo_end()
+    {
+        if(!pheap)
+            return;
+        /* everything the SMO stored is durable before its record goes */
+        persist_fence();
+        pheap->smo_log[epoch_self.slot]=NULL;
+        pheap_persist(&pheap->smo_log[epoch_self.slot],sizeof(void *));
+    }
+
+    /* Crash recovery. open() moves lock_version on, so every lock held when
+       the last run died is stale from then on. All nodes an interrupted SMO
+       touched lie below the first ancestor of its logged node that holds no
+       stale lock. That subtree is rebuilt from its leaf chain, the level
+       whose right links and contents stay usable at every step of an SMO.
+       The stale locks left elsewhere are leaf insert locks, which
+       updateLock() drops on first touch. */
+    static void repair_version(VersionNumber &version, uint64_t flags)
+    {
+        version = (version.v & ~(BOTH_LOCKS|LOCK_VERSION|IS_LEAF|IS_ROOT)) | flags | (lock_version<<44);
+    }
+
+    void* btree::repair_top(void *node)
+    {
+        inner_node *top;
+
+        if(node==root_)
+            return root_;
+        top = *reinterpret_cast<inner_node **>(node);
+        while(top!=root_ && top->version.repair_req())
+            top = top->parent;
+        return top;
+    }
+
+    void btree::repair_pair(leaf_node *a, leaf_node *b)
+    {
+        /* a split or rebalance may have left keys in both leaves, or moved
+           them before the fence between the two caught up: a drops its
+           copies of b's keys and the fence goes between what is left */
+        u_int64_t keys[LEAF_WIDTH], fence;
+        void *values[LEAF_WIDTH];
+        int n=0, j=0, na=a->size(), nb=b->size();
+
+        for(int i=0; i<na; i++) {
+            int p=a->permutation[i];
+            while(j<nb && b->entry[b->permutation[j]].key<a->entry[p].key)
+                j++;
+            if(j<nb && b->entry[b->permutation[j]].key==a->entry[p].key)
+                continue;
+            keys[n]=a->entry[p].key;
+            values[n++]=a->entry[p].link_or_value;
+        }
+        if(n<na) {
+            for(int i=0; i<n; i++) {
+                a->entry[i].key=keys[i];
+                a->entry[i].link_or_value=values[i];
+            }
+            a->permutation=permuter::make_sorted(n);
+            persist(a, sizeof(leaf_node));
+        }
+
+        #define FENCE_OK(f) ((n ? (f)>keys[n-1] : (f)>=a->lowkey) && (f)<=b->entry[b->permutation[0]].key)
+        if(FENCE_OK(a->highkey))
+            fence=a->highkey;
+        else if(FENCE_OK(b->lowkey))
+            fence=b->lowkey;
+        else
+            fence=b->entry[b->permutation[0]].key;
+        #undef FENCE_OK
+        a->highkey=fence;
+        b->lowkey=fence;
+        persist_header(a);
+        persist_header(b);
+    }
+
+    void btree::repair(void *top, std::vector<void *> &garbage)
+    {
+        std::vector<void *> firsts, children, nodes;
+        std::vector<u_int64_t> lows, nlows;
+        std::vector<inner_node *> outl, outr;
+        inner_node *s, *x;
+        leaf_node *a, *b;
+        void *p;
+        u_int64_t high;
+        size_t cn, m;
+        int h, levels;
+
+    again:
+        if(get_version(top).isLeaf()) {
+            /* a leaf root, whose changes are all single stores */
+            repair_version(reinterpret_cast<leaf_node *>(top)->version, IS_LEAF|IS_ROOT);
+            persist_header(top);
+            return;
+        }
+        s = reinterpret_cast<inner_node *>(top);
+        high = s->highkey;
+        firsts.clear();
+        children.clear();
+        lows.clear();
+        for(p=top; !get_version(p).isLeaf(); p=reinterpret_cast<inner_node *>(p)->child0)
+            firsts.push_back(p);
+        h = firsts.size();
+
+        /* empty leaves after the first are unlinked, which also finishes a
+           merge remove() left half done */
+        a = reinterpret_cast<leaf_node *>(p);
+        repair_version(a->version, IS_LEAF);
+        children.push_back(a);
+        lows.push_back(a->lowkey);
+        while(1) {
+            b = a->right;
+            if(!b || b->lowkey>=high)
+                break;
+            if(b->empty()) {
+                a->right = b->right;
+                persist_header(a);
+                garbage.push_back(b);
+                continue;
+            }
+            repair_pair(a,b);
+            b->left = a;
+            repair_version(b->version, IS_LEAF);
+            children.push_back(b);
+            lows.push_back(b->lowkey);
+            a = b;
+        }
+        a->highkey = high;
+        persist_header(a);
+        if(b) {
+            b->left = a;
+            persist_header(b);
+        }
+
+        /* the root may grow a level, any other node keeps its height and
+           hands the job to its parent when the leaves do not fit under it */
+        cn = children.size();
+        levels = 0;
+        if(top==root_) {
+            for(m=cn; m>LEAF_WIDTH+1; m=(m+LEAF_WIDTH)/(LEAF_WIDTH+1))
+                levels++;
+        } else {
+            levels = h-1;
+            m = cn;
+            for(int l=0; l<levels; l++)
+                m = (m+LEAF_WIDTH)/(LEAF_WIDTH+1);
+            if(m>LEAF_WIDTH+1) {
+                top = s->parent;
+                goto again;
+            }
+        }
+
+        /* the inner levels below top are replaced, keeping their outer
+           neighbours to link the new ones to */
+        outl.clear();
+        outr.clear();
+        for(int d=1; d<h; d++) {
+            x = reinterpret_cast<inner_node *>(firsts[d]);
+            outl.push_back(x->left);
+            while(1) {
+                garbage.push_back(x);
+                if(!x->right || x->right->lowkey>=high)
+                    break;
+                x = x->right;
+            }
+            outr.push_back(x->right);
+        }
+
+        for(int l=0; l<levels; l++) {
+            m = (cn+LEAF_WIDTH)/(LEAF_WIDTH+1);
+            nodes.resize(m);
+            nlows.resize(m);
+            bulk_inners(children.data(), lows.data(), cn, m, 0, m, nodes.data(), nlows.data());
+            reinterpret_cast<inner_node *>(nodes[0])->lowkey = nlows[0] = s->lowkey;
+            reinterpret_cast<inner_node *>(nodes[m-1])->highkey = high;
+            if(top!=root_) {
+                x = reinterpret_cast<inner_node *>(nodes[0]);
+                x->left = outl[h-2-l];
+                if(x->left) {
+                    x->left->right = x;
+                    persist_header(x->left);
+                }
+                x = reinterpret_cast<inner_node *>(nodes[m-1]);
+                x->right = outr[h-2-l];
+                if(x->right) {
+                    x->right->left = x;
+                    persist_header(x->right);
+                }
+            }
+            children.swap(nodes);
+            lows.swap(nlows);
+            cn = m;
+        }
+
+        /* top itself is refilled in place, like the root in bulk_load */
+        s->child0 = children[0];
+        update_parent(children[0],s);
+        bulk_flush(children[0]);
+        for(size_t j=1; j<cn; j++) {
+            s->entry[j-1].key = lows[j];
+            s->entry[j-1].link_or_value = children[j];
+            update_parent(children[j],s);
+            bulk_flush(children[j]);
+        }
+        s->permutation = permuter::make_sorted(cn-1);
+        repair_version(s->version, top==root_ ? IS_ROOT : 0);
+        bulk_flush(s);
+    }
+
+    void btree::recover()
+    {
+        std::vector<void *> tops, garbage;
+        bool covered;
+
+        lock_version = pheap->lock_version%MAX_VERSION+1;
+        pheap->lock_version = lock_version;
+        pheap_persist(&pheap->lock_version,sizeof(u_int64_t));
+
+        for(int i=0; i<EPOCH_THREADS; i++) {
+            if(pheap->smo_log[i])
+                tops.push_back(repair_top(pheap->smo_log[i]));
+        }
+        /* a subtree inside another one is rebuilt along with it */
+        for(size_t i=0; i<tops.size(); i++) {
+            covered = false;
+            for(size_t j=0; j<tops.size() && !covered; j++) {
+                if(i==j || !tops[j])
+                    continue;
+                for(void *x=tops[i]; x && !covered; x=*reinterpret_cast<void **>(x))
+                    covered = (x==tops[j]);
+            }
+            if(covered)
+                tops[i] = NULL;
+        }
+        for(size_t i=0; i<tops.size(); i++) {
+            if(tops[i] && std::find(garbage.begin(),garbage.end(),tops[i])==garbage.end())
+                repair(tops[i],garbage);
+        }
+
+        /* the garbage sits in chunks of the last run, where reclaim()
+           finds it free along with everything else the tree lost */
+        if(pheap_old)
+            reclaim();
+        else {
+            std::sort(garbage.begin(),garbage.end());
+            garbage.erase(std::unique(garbage.begin(),garbage.end()),garbage.end());
+            for(size_t i=0; i<garbage.size(); i++) {
+                if(get_version(garbage[i]).isLeaf())
+                    delete reinterpret_cast<leaf_node *>(garbage[i]);
+                else
+                    delete reinterpret_cast<inner_node *>(garbage[i]);
+            }
+        }
+        persist_fence();
+        for(int i=0; i<EPOCH_THREADS; i++)
+            pheap->smo_log[i] = NULL;
+        pheap_persist(pheap->smo_log,sizeof(pheap->smo_log));
+        pheap_sync();
+    }
+
+    /* Nodes live in NODE_ALIGN aligned slots carved out of chunks of
+       NODE_CHUNK slots. Each thread allocates from and frees into its own
+       list; a thread holding too many spills a chunk's worth back to the
+       shared list and an exiting thread returns all of it. Chunks are
+       never handed back to the allocator; in a pheap build each is linked
+       into pheap->chunks through the word in front of its first slot. */
+    static const size_t node_slot=((sizeof(leaf_node)>sizeof(inner_node)?sizeof(leaf_node):sizeof(inner_node))
+                                   +NODE_ALIGN-1)&~(size_t)(NODE_ALIGN-1);
+
+    struct node_cache {
+        void        *head;
+        u_int64_t   count;
+        int         state;      // 0 unused, 1 active, 2 thread exiting
+    };
+
+    static void                 *pool_head=NULL;
+    static u_int64_t            pool_count=0;
+    static volatile int         pool_lock=0;
+    static std::atomic<u_int64_t> pool_reserved_n(0);
+    static std::atomic<u_int64_t> pool_live_n(0);
+
+    /* trivially destructible so frees made by later thread_local
+       destructors (epoch_local) still find it */
+    static thread_local node_cache pool_self;
+
+    #define NEXT_SLOT(p) (*reinterpret_cast<void **>(p))
+
+    /* moves n slots from the head of the thread's list to the shared one */
+    static void pool_spill(node_cache &c, u_int64_t n)
+    {
+        void *first=c.head, *last=c.head;
+        for(u_int64_t i=1; i<n; i++)
+            last=NEXT_SLOT(last);
+        c.head=NEXT_SLOT(last);
+        c.count-=n;
+
+        while(__sync_lock_test_and_set(&pool_lock,1));
+        NEXT_SLOT(last)=pool_head;
+        pool_head=first;
+        pool_count+=n;
+        __sync_lock_release(&pool_lock);
+    }
+
+    class pool_drain
+    {
+        public:
+            int armed;
+
+            ~pool_drain()
+            {
+                if(pool_self.count)
+                    pool_spill(pool_self,pool_self.count);
+                pool_self.state=2;
+            }
+    };
+
+    static thread_local pool_drain pool_exit;
+
+    /* first slot of a chunk, past the link word at its start */
+    static inline char* chunk_slots(char *raw)
+    {
+        return reinterpret_cast<char *>(((uintptr_t)raw+NODE_ALIGN)&~(uintptr_t)(NODE_ALIGN-1));
+    }
+
+    /* pops one slot off the shared list, carving a new chunk into it
+       when empty, NULL when the allocator is out of memory; called with
+       pool_lock held */
+    static void* pool_take()
+    {
+        void *p;
+        if(!pool_head) {
+            char *raw=reinterpret_cast<char *>(RRP_malloc(NODE_CHUNK*node_slot+NODE_ALIGN));
+            if(!raw)
+                return NULL;
+            char *slots=chunk_slots(raw);
+            if(pheap) {
+                *reinterpret_cast<char **>(raw)=pheap->chunks;
+                pheap_persist(raw,sizeof(char *));
+                pheap->chunks=raw;
+                pheap_persist(&pheap->chunks,sizeof(char *));
+            }
+            for(u_int64_t i=0; i<NODE_CHUNK; i++)
+                NEXT_SLOT(slots+i*node_slot)=(i+1<NODE_CHUNK)?slots+(i+1)*node_slot:NULL;
+            pool_head=slots;
+            pool_count=NODE_CHUNK;
+            pool_reserved_n.fetch_add(NODE_CHUNK,std::memory_order_relaxed);
+        }
+        p=pool_head;
+        pool_head=NEXT_SLOT(p);
+        pool_count--;
+        return p;
+    }
+
+    static void* node_alloc(size_t size)
+    {
+        node_cache &c=pool_self;
+        void *p;
+        assert(size<=node_slot);
+        if(!c.head) {
+            if(c.state==0) {
+                pool_exit.armed=1;
+                c.state=1;
+            }
+            while(__sync_lock_test_and_set(&pool_lock,1));
+            p=pool_take();
+            if(!p) {
+                fprintf(stderr,"masstree: out of memory for a node chunk\n");
+                abort();
+            }
+            /* take a chunk's worth along unless the thread is going away */
+            if(c.state==1) {
+                for(u_int64_t i=1; i<NODE_CHUNK; i++) {
+                    void *q=pool_take();
+                    if(!q)
+                        break;
+                    NEXT_SLOT(q)=c.head;
+                    c.head=q;
+                    c.count++;
+                }
+            }
+            __sync_lock_release(&pool_lock);
+        }
+        else {
+            p=c.head;
+            c.head=NEXT_SLOT(p);
+            c.count--;
+        }
+        pool_live_n.fetch_add(1,std::memory_order_relaxed);
+        return p;
+    }
+
+    static void node_release(void *p)
+    {
+        node_cache &c=pool_self;
+        pool_live_n.fetch_sub(1,std::memory_order_relaxed);
+        if(c.state==0) {
+            pool_exit.armed=1;
+            c.state=1;
+        }
+        NEXT_SLOT(p)=c.head;
+        c.head=p;
+        c.count++;
+        if(c.state==2 || c.count>=2*NODE_CHUNK)
+            pool_spill(c,c.state==2?c.count:NODE_CHUNK);
+    }
+
+    /* Free slots only live in volatile lists, so after a restart every
+       slot of the chunks the last run carved that the tree does not reach
+       goes back on the shared list: nodes it freed, nodes retired in
+       epochs it did not finish and nodes a crashed SMO left behind. */
+    void btree::reclaim()
+    {
+        std::vector<void *> live, todo;
+        inner_node *inner;
+        char *chunk, *slots;
+        void *p;
+
+        todo.push_back(root_);
+        while(!todo.empty()) {
+            p=todo.back();
+            todo.pop_back();
+            live.push_back(p);
+            if(get_version(p).isLeaf())
+                continue;
+            inner=reinterpret_cast<inner_node *>(p);
+            todo.push_back(inner->child0);
+            for(int i=0; i<inner->permutation.size(); i++)
+                todo.push_back(inner->entry[inner->permutation[i]].link_or_value);
+        }
+        std::sort(live.begin(),live.end());
+
+        while(__sync_lock_test_and_set(&pool_lock,1));
+        for(chunk=pheap_old; chunk; chunk=*reinterpret_cast<char **>(chunk)) {
+            slots=chunk_slots(chunk);
+            for(u_int64_t i=0; i<NODE_CHUNK; i++) {
+                p=slots+i*node_slot;
+                if(std::binary_search(live.begin(),live.end(),p)) {
+                    pool_live_n.fetch_add(1,std::memory_order_relaxed);
+                    continue;
+                }
+                NEXT_SLOT(p)=pool_head;
+                pool_head=p;
+                pool_count++;
+            }
+            pool_reserved_n.fetch_add(NODE_CHUNK,std::memory_order_relaxed);
+        }
+        pheap_old=NULL;
+        __sync_lock_release(&pool_lock);
+    }
+
+    #undef NEXT_SLOT
+
+#ifdef CRASH_SIM
+    /* forgets the volatile state a process started on the crash image
+       would not have; the heap stays mapped where it is */
+    void sim_restart()
+    {
+        pheap_lock=0;
+        pool_lock=0;
+        pool_head=NULL;
+        pool_count=0;
+        pool_reserved_n=0;
+        pool_live_n=0;
+        pheap_old=pheap ? pheap->chunks : NULL;
+        pool_self.head=NULL;
+        pool_self.count=0;
+        flush_set.n=0;
+        flush_set.unfenced=false;
+        for(int i=0; i<3; i++)
+            epoch_self.limbo[i].clear();
+        orphans.clear();
+        orphan_epoch=0;
+    }
+#endif
+
+    void* btree::operator new(size_t size)
+    {
+        void *ptr = RRP_malloc(size);
+        memset(ptr,0,size);
+
+        return ptr;
+    }
+
+    void btree::operator delete(void *addr)
+    {
+        RRP_free(addr);
+    }
+
+    btree* btree::open(const char *path)
+    {
+#if defined(DRAM) || defined(RALLOC)
+        (void)path;
+        return NULL;
+#else
+        btree *tree;
+        int ret;
+
+        while(__sync_lock_test_and_set(&pheap_lock,1));
+        ret=pheap_map(path);
+        __sync_lock_release(&pheap_lock);
+        if(ret)
+            return NULL;
+        if(pheap->root) {
+            tree=new btree(pheap->root);
+            tree->recover();
+            return tree;
+        }
+
+        tree=new btree;
+        if(pheap_old)
+            tree->reclaim();
+        pheap->root=tree->root_;
+        pheap_persist(&pheap->root,sizeof(void *));
+        return tree;
+#endif
+    }
+
+    void* leaf_node::operator new(size_t size)
+    {
+        void *ptr = node_alloc(size);
+        memset(ptr,0,size);
+
+        STAT_INC(STAT_NODES);
+
+        return ptr;
+    }
+
+    void leaf_node::operator delete(void *addr)
+    {
+        STAT_ADD(STAT_NODES,-1);
+        node_release(addr);
+    }
+
+    void* inner_node::operator new(size_t size)
+    {
+        void *ptr = node_alloc(size);
+        memset(ptr,0,size);
+
+        STAT_INC(STAT_NODES);
+
+        return ptr;
+    }
+
+    void inner_node::operator delete(void *addr)
+    {
+        STAT_ADD(STAT_NODES,-1);
+        node_release(addr);
+    }
+
+#ifdef STATS
+    u_int64_t btree::tot_nodes()
+    {
+        return stat_sum(STAT_NODES);
+    }
+
+    u_int64_t btree::tot_lookups()
+    {
+        return stat_sum(STAT_LOOKUPS);
+    }
+
+    u_int64_t btree::tot_inserts()
+    {
+        return stat_sum(STAT_INSERTS);
+    }
+
+    u_int64_t btree::tot_splits()
+    {
+        return stat_sum(STAT_SPLITS);
+    }
+
+    u_int64_t btree::tot_rebalances()
+    {
+        return stat_sum(STAT_REBALANCES);
+    }
+
+    u_int64_t btree::tot_retries()
+    {
+        u_int64_t n=0;
+        for(int op=0; op<OP_COUNT; op++)
+            n+=stat_sum(STAT_EVENT(op,EV_RESTART));
+        return n;
+    }
+
+    void btree::contention(contention_stats &s)
+    {
+        for(int op=0; op<OP_COUNT; op++)
+            for(int ev=0; ev<EV_COUNT; ev++)
+                s.events[op][ev]=stat_sum(STAT_EVENT(op,ev));
+        for(int l=0; l<CONTENTION_LEVELS; l++)
+            s.hot[l]=stat_sum(STAT_HOT(l));
+    }
+
+    void thread_stats(thread_counts &c)
+    {
+        stat_slot *s=stat_self.slot;
+        memset(&c,0,sizeof(c));
+        if(s==NULL)
+            return;
+        c.splits=s->n[STAT_SPLITS];
+        c.rebalances=s->n[STAT_REBALANCES];
+        for(int op=0; op<OP_COUNT; op++) {
+            c.retries+=s->n[STAT_EVENT(op,EV_RESTART)]+s->n[STAT_EVENT(op,EV_HOP)]+
+                       s->n[STAT_EVENT(op,EV_VALIDATE)];
+            c.waits+=s->n[STAT_EVENT(op,EV_INSERT_SPIN)]+s->n[STAT_EVENT(op,EV_SMO_SPIN)];
+        }
+    }
+
+    /* filled entry slots over the slots of every live node */
+    double btree::efficiency()
+    {
+        int64_t nodes=stat_sum(STAT_NODES);
+        if(nodes<=0)
+            return 0;
+        return (double)stat_sum(STAT_ENTRIES)/(nodes*LEAF_WIDTH);
+    }
+#else
+    u_int64_t btree::tot_nodes(){return 0;}
+    u_int64_t btree::tot_lookups(){return 0;}
+    u_int64_t btree::tot_inserts(){return 0;}
+    u_int64_t btree::tot_splits(){return 0;}
+    u_int64_t btree::tot_rebalances(){return 0;}
+    u_int64_t btree::tot_retries(){return 0;}
+    void btree::contention(contention_stats &s){memset(&s,0,sizeof(s));}
+    void thread_stats(thread_counts &c){memset(&c,0,sizeof(c));}
+    double btree::efficiency(){return 0;}
+#endif
+
+    u_int64_t btree::pool_live()
+    {
+        return pool_live_n.load(std::memory_order_relaxed);
+    }
+
+    u_int64_t btree::pool_free()
+    {
+        u_int64_t reserved=pool_reserved_n.load(std::memory_order_relaxed);
+        u_int64_t live=pool_live_n.load(std::memory_order_relaxed);
+        return reserved>live?reserved-live:0;
+    }
+
+    u_int64_t btree::pool_reserved()
     {
-        return space;
+        return pool_reserved_n.load(std::memory_order_relaxed);
     }
 
     void btree::print_tree()
@@ -1,17 +1,37 @@
 #include <cstdio>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <math.h>
 #include <iostream>
 #include <mutex>
 #include <atomic>
+#include <vector>
+#include <algorithm>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <emmintrin.h>
+#include <immintrin.h>
+#include <cpuid.h>
 
 
 #define REBAL
 #define DRAM
-//#define STATS
+//#define RALLOC
+#define SIMD_SEARCH
+#define SPLIT_KV
+#define STATS
+
+/* crash_test.cc runs the tree on the built-in persistent heap */
+#ifdef CRASH_SIM
+#undef DRAM
+#undef RALLOC
+#endif
 
 namespace masstree
 {
@@ -19,6 +39,9 @@ namespace masstree
 #define LEAF_WIDTH          15
 #define LEAF_THRESHOLD      1
 
+/* cache lines one operation queues before they are written back early */
+#define FLUSH_SET           32
+
 #define INITIAL_VALUE       0x0123456789ABCDE0ULL
 #define FULL_VALUE          0xEDCBA98765432100ULL
 
@@ -27,6 +50,13 @@ namespace masstree
 #define LV_PTR(x)           (leafvalue*)((void*)((uintptr_t)x & ~LV_BITS))
 #define SET_LV(x)           ((void*)((uintptr_t)x | LV_BITS))
 
+/* a leaf value tagged IV is the value itself, up to 62 bits, and is never
+   freed or read through by the tree */
+#define IV_BITS             (1ULL << 1)
+#define IS_IV(x)            ((uintptr_t)(x) & IV_BITS)
+#define IV_GET(x)           ((u_int64_t)((uintptr_t)(x) >> 2))
+#define SET_IV(x)           ((void*)(((uintptr_t)(x) << 2) | IV_BITS))
+
 
 #define INSERT_LOCK 0b1ULL
 #define SMO_LOCK 0b10ULL
@@ -43,18 +73,38 @@ namespace masstree
 #define INSERT_INCREMENT 0x10ULL
 #define SMO_INCREMENT 0x1000000ULL
 
+/* a lock waiter pauses 1, 2, 4.. up to BACKOFF_MAX times between tries,
+   after that it yields the cpu to whoever holds the lock */
+#define BACKOFF_MAX 64
+
+
 
+/* bumped every time a persistent heap is opened; a lock word carrying an
+   older value was held by a run that crashed */
+extern uint64_t lock_version;
 
 class VersionNumber {
 public:
-    uint64_t v;
+    volatile uint64_t v;
     VersionNumber();
     VersionNumber(uint64_t v_) {
         v=v_;
     }
+    /* snapshots and validations are compiler barriers, so node reads stay
+       between the two and retry loops reload the version every pass */
+    VersionNumber(VersionNumber const &a) {
+        asm volatile("" ::: "memory");
+        v=a.v;
+        asm volatile("" ::: "memory");
+    }
     void operator=(uint64_t v_) {
         v=v_;
     }
+    void operator=(VersionNumber const &a) {
+        asm volatile("" ::: "memory");
+        v=a.v;
+        asm volatile("" ::: "memory");
+    }
     void markRoot() {
         __sync_or_and_fetch(&v,IS_ROOT);
     }
@@ -67,13 +117,23 @@ public:
     void unmarkLeaf() {
         __sync_and_and_fetch(&v,~IS_LEAF);
     }
+    /* the plain read first keeps waiters on a shared copy of the line
+       until the lock looks free */
     uint64_t tryInsertLock() {
+        if(lockVersion()!=lock_version)
+            updateLock();
+        if(v&INSERT_LOCK)
+            return INSERT_LOCK;
         return (__sync_fetch_and_or(&v,INSERT_LOCK))&INSERT_LOCK;
     }
     void releaseInsertLock() {
         __sync_fetch_and_and(&v,~INSERT_LOCK);
     }
     uint64_t trySMOLock() {
+        if(lockVersion()!=lock_version)
+            updateLock();
+        if(v&SMO_LOCK)
+            return SMO_LOCK;
         return (__sync_fetch_and_or(&v,BOTH_LOCKS))&SMO_LOCK;
     }
     void releaseSMOLock() {
@@ -84,11 +144,14 @@ public:
         incrementInsert(), incrementSMO();
         __sync_fetch_and_and(&v,~BOTH_LOCKS);
     }
+    /* locks left behind by an earlier run do not count */
     bool smoLock() {
-        return v&SMO_LOCK;
+        uint64_t x=v;
+        return (x&SMO_LOCK) && (x>>44)==lock_version;
     }
     bool insertLock() {
-        return v&INSERT_LOCK;
+        uint64_t x=v;
+        return (x&INSERT_LOCK) && (x>>44)==lock_version;
     }
     bool isRoot() {
         return v&IS_ROOT;
@@ -120,6 +183,7 @@ public:
     bool repair_req();
     uint updateLock();
     bool operator!= (VersionNumber const &a) {
+        asm volatile("" ::: "memory");
         return v!=a.v;
     }
 };
@@ -363,6 +427,19 @@ typedef struct key_indexed_position
     }
 } key_indexed_position;
 
+/* instruction set used by the node search kernels, picked at startup */
+enum search_isa { SEARCH_SCALAR, SEARCH_SSE42, SEARCH_AVX2 };
+
+search_isa get_search_isa();
+bool set_search_isa(search_isa isa);
+
+/* cache line write back used to persist, picked at startup; FLUSH_NONE
+   leaves the lines in the cache. A DRAM build never writes back. */
+enum flush_isa { FLUSH_NONE, FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB };
+
+flush_isa get_flush_isa();
+bool set_flush_isa(flush_isa isa);
+
 class kv
 {
     private:
@@ -379,6 +456,36 @@ class kv
         friend class btree;
 };
 
+#ifdef SPLIT_KV
+/* Struct-of-arrays node body: the 15 keys fill two cache lines on their own,
+   so a search never touches the values. entry[i] hands out a kv_ref that
+   reads and assigns like a kv. */
+class kv_ref
+{
+    public:
+        u_int64_t   &key;
+        void        *&link_or_value;
+
+        kv_ref(u_int64_t &key, void *&value):key(key),link_or_value(value){}
+        kv_ref &operator=(const kv_ref &e) {
+            key=e.key;
+            link_or_value=e.link_or_value;
+            return *this;
+        }
+};
+
+class kv_array
+{
+    public:
+        u_int64_t   key[LEAF_WIDTH];                                //120B
+        void        *link_or_value[LEAF_WIDTH];                     //120B
+
+        kv_ref operator[](int i) {
+            return kv_ref(key[i],link_or_value[i]);
+        }
+};
+#endif
+
 class inner_node
 {
     private:
@@ -390,7 +497,11 @@ class inner_node
         u_int64_t               lowkey;                             //8B
         permuter                permutation;                        //8B
         void                    *child0;                            //8B
+#ifdef SPLIT_KV
+        kv_array                entry;                              //240B
+#else
         kv                      entry[LEAF_WIDTH];                  //240B
+#endif
 
     public:
 
@@ -432,7 +543,6 @@ class inner_node
         int rebalance(u_int64_t key, void* value, VersionNumber* &v1, VersionNumber* &v2);
         int remove(u_int64_t key);
         inner_node* give_parent();
-        void del();
         void* get(u_int64_t key);
         void* get_exact(u_int64_t key);
 
@@ -456,7 +566,11 @@ class leaf_node
                                 lowkey;                             //8B
         permuter                permutation;                        //8B
         u_int64_t               dummy;                              //8B
+#ifdef SPLIT_KV
+        kv_array                entry;                              //240B
+#else
         kv                      entry[LEAF_WIDTH];                  //240B
+#endif
     
     public:
 
@@ -499,48 +613,241 @@ class leaf_node
         kv split(u_int64_t key, void* value, VersionNumber* &v1, VersionNumber* &v2);
         int rebalance(u_int64_t key, void* value);
         int remove(u_int64_t key);
+        int update(u_int64_t key, void *value, void **expected);
         inner_node* give_parent();
         void del();
         void* get(u_int64_t key);
 
         int full(){return permutation.size()==LEAF_WIDTH;}
         int empty(){return permutation.size()==0;}
+        int dead(){return lowkey>highkey;}
         int capacity(){return LEAF_WIDTH;}
 
         friend class btree;
         friend class inner_node;
 };
 
+/* epoch based reclamation: tree operations run between epoch_enter() and
+   epoch_exit(), and memory given to epoch_retire() is released once every
+   thread has left the epoch it was retired in */
+#define EPOCH_THREADS       128
+#define EPOCH_BATCH         64
+
+/* descents multi_get keeps in flight at once */
+#define MULTI_GET_GROUP     16
+
+/* nodes of one bulk load level a worker thread gets at least */
+#define BULK_MIN_NODES      4096
+
+/* node pool: slot alignment and slots carved per refill */
+#define NODE_ALIGN          256
+#define NODE_CHUNK          1024
+
+/* file backed heap used for nodes when neither DRAM nor RALLOC is set,
+   mapped at PHEAP_BASE; values handed to such a tree come from
+   pheap_malloc() since remove() gives them back to pheap_free() */
+#define PHEAP_FILE          "masstree.heap"
+#define PHEAP_BASE          0x200000000000ULL
+#define PHEAP_SIZE          (1ULL << 34)
+#define PHEAP_CLASSES       12
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+struct bulk_task;
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, void (*release)(void *));
+
+void* pheap_malloc(size_t size);
+void pheap_free(void *ptr);
+void pheap_sync();
+/* bytes of the heap handed out so far, 0 when it is not mapped */
+u_int64_t pheap_used();
+
+/* built with -DCRASH_SIM the tree reports every flushed cache line and
+   every fence to crash_test.cc, which defines sim_flush() and sim_fence();
+   site is the flushing code. sim_restart() resets the tree's volatile
+   state in a process that carries on from a crash image. */
+#ifdef CRASH_SIM
+void sim_flush(void *line, void *site);
+void sim_fence(void *site);
+void sim_restart();
+#endif
+
+class epoch_guard
+{
+    public:
+        epoch_guard(){epoch_enter();}
+        ~epoch_guard(){epoch_exit();}
+};
+
+/* what the optimistic descents ran into, per operation: restarts from the
+   root, hops to a sibling after an SMO, failed version validations and
+   failed tries on insert and SMO locks. hot[l] counts the failed
+   validations and lock tries on nodes l levels below the root, the last
+   bucket taking everything deeper. */
+enum { OP_GET, OP_INSERT, OP_REMOVE, OP_UPDATE, OP_COUNT };
+enum { EV_RESTART, EV_HOP, EV_VALIDATE, EV_INSERT_SPIN, EV_SMO_SPIN, EV_COUNT };
+#define CONTENTION_LEVELS   8
+
+struct contention_stats
+{
+    u_int64_t   events[OP_COUNT][EV_COUNT];
+    u_int64_t   hot[CONTENTION_LEVELS];
+};
+
+/* the calling thread's own counts so far, zero without STATS; read around
+   one operation they tell whether it split, rebalanced, had to retry (a
+   restart, sibling hop or failed validation) or waited on a lock */
+struct thread_counts
+{
+    u_int64_t   splits;
+    u_int64_t   rebalances;
+    u_int64_t   retries;
+    u_int64_t   waits;
+};
+
+void thread_stats(thread_counts &c);
+
+/* called for every entry of a scan in key order, return false to stop */
+typedef bool (*scan_callback)(u_int64_t key, void *value, void *arg);
+/* given the value of a key, NULL when it is missing, returns the one to
+   store; it runs under the leaf lock and must not call into the tree */
+typedef void* (*rmw_callback)(void *value, void *arg);
+
 class btree
 {
     private:
         void *root_;
 
     public:
+        /* walks the leaf chain in key order from the first key >= start,
+           one validated leaf snapshot at a time; it keeps the creating
+           thread inside an epoch while alive and must die on that thread */
+        class iterator
+        {
+            private:
+                btree       *tree;
+                leaf_node   *next_leaf;
+                u_int64_t   next_key;
+                bool        last;
+                int         pos,
+                            size;
+                u_int64_t   keys[LEAF_WIDTH];
+                void        *values[LEAF_WIDTH];
+
+                void fill();
+
+            public:
+                iterator(btree *tree, u_int64_t start);
+                iterator(const iterator &it);
+                ~iterator();
+
+                bool valid(){return pos<size;}
+                u_int64_t key(){return keys[pos];}
+                void* value(){return values[pos];}
+                iterator &operator++();
+        };
+
+        /* same walk in descending key order from the last key <= start,
+           following the left sibling links */
+        class reverse_iterator
+        {
+            private:
+                btree       *tree;
+                leaf_node   *next_leaf;
+                u_int64_t   next_key;
+                bool        last;
+                int         pos,
+                            size;
+                u_int64_t   keys[LEAF_WIDTH];
+                void        *values[LEAF_WIDTH];
+
+                void fill();
+
+            public:
+                reverse_iterator(btree *tree, u_int64_t start);
+                reverse_iterator(const reverse_iterator &it);
+                ~reverse_iterator();
+
+                bool valid(){return pos<size;}
+                u_int64_t key(){return keys[pos];}
+                void* value(){return values[pos];}
+                reverse_iterator &operator++();
+        };
+
         btree(){init_root();}
         btree(void *root):root_(root){}
         void *operator new(size_t size);
         void operator delete(void *addr);
+        /* maps the heap file at path, creating it if needed, and returns
+           the tree recorded in it or a new one recorded there; NULL when
+           the heap cannot be mapped or nodes do not live in it */
+        static btree* open(const char *path);
 
-        int insert(u_int64_t key, void *value);
+        int insert(u_int64_t key, void *value){return insert(key,value,NULL,NULL);}
         void remove(u_int64_t key);
         void* get(u_int64_t key);
+        /* values of present keys are replaced in place without an SMO; the
+           tree frees the old one as remove() would. upsert() returns 1 when
+           it inserted and 0 when it replaced */
+        int upsert(u_int64_t key, void *value);
+        int update(u_int64_t key, void *value);
+        int compare_and_swap(u_int64_t key, void *expected, void *desired);
+        /* applies callback to the value of key in one descent, inserting
+           its result when key is missing; returns 1 only then */
+        int rmw(u_int64_t key, rmw_callback callback, void *arg){return insert(key,NULL,callback,arg);}
+        void multi_get(const u_int64_t *keys, void **out, size_t n);
+        int bulk_load(const u_int64_t *keys, void **values, size_t n, double fill_factor, int threads=1);
+        int scan(u_int64_t start, int count, scan_callback callback, void *arg);
+        int rscan(u_int64_t start, int count, scan_callback callback, void *arg);
+
+        iterator lower_bound(u_int64_t start){return iterator(this,start);}
+        iterator begin(){return iterator(this,0);}
+        reverse_iterator rbegin(u_int64_t start=UINT64_MAX){return reverse_iterator(this,start);}
 
         u_int64_t tot_nodes();
         double efficiency();
+        u_int64_t pool_live();
+        u_int64_t pool_free();
+        u_int64_t pool_reserved();
+        /* counted per thread under STATS and summed here, so a read while
+           other threads run is approximate */
         u_int64_t tot_lookups();
         u_int64_t tot_inserts();
+        u_int64_t tot_splits();
         u_int64_t tot_rebalances();
+        u_int64_t tot_retries();
+        void contention(contention_stats &s);
         void print_tree();
 
     private:
         void new_root();
+        int insert(u_int64_t key, void *value, rmw_callback callback, void *arg);
+        leaf_node* find_leaf(u_int64_t key);
+        leaf_node* lock_leaf(u_int64_t key);
+        void bulk_leaves(const u_int64_t *keys, void **values, size_t n, size_t m,
+                         size_t from, size_t to, void **nodes, u_int64_t *lows);
+        void bulk_inners(void **children, const u_int64_t *lows, size_t n, size_t m,
+                         size_t from, size_t to, void **nodes, u_int64_t *nlows);
+        void bulk_level(bulk_task *task, int threads);
+        static void* bulk_worker(void *arg);
+        int scan_leaf(leaf_node* &leaf, u_int64_t &key, u_int64_t *keys, void **values);
+        int rscan_leaf(leaf_node* &leaf, u_int64_t &key, bool &last, u_int64_t *keys, void **values);
         VersionNumber get_version(void *node);
         void* get_child0(void *node)
         {
-            return node+56;
+            return reinterpret_cast<char *>(node)+offsetof(inner_node,child0);
         }
         void init_root();
+        void recover();
+        void reclaim();
+        void* repair_top(void *node);
+        void repair_pair(leaf_node *a, leaf_node *b);
+        void repair(void *top, std::vector<void *> &garbage);
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <time.h>
+
+using namespace std;
+
+#include "masstree.h"
+
+static __uint128_t g_lehmer64_state;
+
+static void init_seed(void) {
+   srand(time(NULL));
+   g_lehmer64_state = rand();
+}
+
+static uint64_t lehmer64() {
+  g_lehmer64_state *= 0xda942042e4dd58b5;
+  return g_lehmer64_state >> 64;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    int num_keys = 10000000;
+    int num_lookups = 10000000;
+    int batch = 64;
+    if(argc>1)
+        num_keys = atoi(argv[1]);
+    if(argc>2)
+        num_lookups = atoi(argv[2]);
+    if(argc>3)
+        batch = atoi(argv[3]);
+
+    masstree::btree *tree = new masstree::btree;
+    u_int64_t *keys = new u_int64_t[num_keys];
+    u_int64_t *probes = new u_int64_t[num_lookups];
+    void **expect = new void*[num_lookups];
+    void **out = new void*[num_lookups];
+
+    init_seed();
+    for(int i=0; i<num_keys; i++)
+    {
+        keys[i]=lehmer64();
+        tree->insert(keys[i],malloc(4));
+    }
+    for(int i=0; i<num_lookups; i++)
+        probes[i] = (i&1) ? keys[lehmer64()%num_keys] : lehmer64();
+
+    cout<<"number of keys: "<<num_keys<<", lookups: "<<num_lookups<<", batch: "<<batch<<"\n";
+
+    double start=now();
+    for(int i=0; i<num_lookups; i++)
+        expect[i]=tree->get(probes[i]);
+    double elapsed=now()-start;
+    cout<<"get: "<<elapsed*1e9/num_lookups<<" ns/lookup, "
+        <<num_lookups/elapsed/1e6<<"M lookups/s\n";
+
+    start=now();
+    for(int i=0; i<num_lookups; i+=batch)
+        tree->multi_get(probes+i,out+i,num_lookups-i<batch ? num_lookups-i : batch);
+    elapsed=now()-start;
+
+    int mismatch=0;
+    for(int i=0; i<num_lookups; i++)
+        mismatch+=(out[i]!=expect[i]);
+    cout<<"multi_get: "<<elapsed*1e9/num_lookups<<" ns/lookup, "
+        <<num_lookups/elapsed/1e6<<"M lookups/s"
+        <<(mismatch ? " (MISMATCH)" : "")<<"\n";
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+#include <iostream>
+#include <cctype>
+#include <string>
+#include <time.h>
+
+using namespace std;
+
+#include "masstree.h"
+
+/* YCSB style driver for the concurrent tree.
+
+   usage: ycsb_bench [workload] [distribution] [threads] [records] [seconds] [warmup]
+
+   workload is one of the core mixes A-F; distribution is uniform, zipfian,
+   latest or sequential; left out or given as - it is the one the mix is
+   defined with.
+   The records are loaded by all threads, then every thread runs the mix for
+   warmup seconds unmeasured and seconds measured. Every measured operation
+   is timed and filed by what it ran into in the tree, going by the thread's
+   own STATS counts around it. The last line of the output is a JSON object
+   with the configuration and the results, latencies in ns. */
+
+enum { YCSB_READ, YCSB_UPDATE, YCSB_INSERT, YCSB_SCAN, YCSB_RMW, YCSB_OPS };
+static const char *op_names[YCSB_OPS] = {"read", "update", "insert", "scan", "rmw"};
+
+enum { DIST_UNIFORM, DIST_ZIPFIAN, DIST_LATEST, DIST_SEQUENTIAL, DISTS };
+static const char *dist_names[DISTS] = {"uniform", "zipfian", "latest", "sequential"};
+
+struct workload {
+    char    name;
+    int     mix[YCSB_OPS];   /* percent of each operation */
+    int     dist;
+};
+
+static const workload workloads[] = {
+    {'A', {50, 50,  0,  0,  0}, DIST_ZIPFIAN},
+    {'B', {95,  5,  0,  0,  0}, DIST_ZIPFIAN},
+    {'C', {100, 0,  0,  0,  0}, DIST_ZIPFIAN},
+    {'D', {95,  0,  5,  0,  0}, DIST_LATEST},
+    {'E', { 0,  0,  5, 95,  0}, DIST_ZIPFIAN},
+    {'F', {50,  0,  0,  0, 50}, DIST_ZIPFIAN},
+};
+
+#define SCAN_MAX        100
+#define ZIPF_THETA      0.99
+
+enum { PHASE_WARMUP, PHASE_MEASURE, PHASE_STOP };
+
+enum { LAT_PLAIN, LAT_SPLIT, LAT_REBALANCE, LAT_RETRY, LAT_WAIT, LAT_CLASSES };
+static const char *lat_names[LAT_CLASSES] = {"plain", "split", "rebalance", "retry", "lock_wait"};
+
+/* HDR style histogram: below 2^LAT_SUB_BITS ns every value has a bucket,
+   above that each power of two is cut into 2^LAT_SUB_BITS buckets, so a
+   percentile is within 1/16 of the truth. Each thread fills its own and
+   they are summed once the threads are gone. */
+#define LAT_SUB_BITS    4
+#define LAT_SUB         (1<<LAT_SUB_BITS)
+#define LAT_BUCKETS     ((64-LAT_SUB_BITS+1)*LAT_SUB)
+
+struct latency_hist {
+    u_int64_t   count[LAT_BUCKETS];
+    u_int64_t   total;
+    u_int64_t   max;
+
+    static int bucket(u_int64_t ns) {
+        if(ns<LAT_SUB)
+            return ns;
+        int k=63-__builtin_clzll(ns);
+        return (k-LAT_SUB_BITS+1)*LAT_SUB+((ns>>(k-LAT_SUB_BITS))&(LAT_SUB-1));
+    }
+    /* the largest value filed in bucket b */
+    static u_int64_t bucket_top(int b) {
+        if(b<LAT_SUB)
+            return b;
+        int k=b/LAT_SUB+LAT_SUB_BITS-1;
+        return ((u_int64_t)(LAT_SUB+b%LAT_SUB+1)<<(k-LAT_SUB_BITS))-1;
+    }
+    void record(u_int64_t ns) {
+        count[bucket(ns)]++;
+        total++;
+        if(ns>max)
+            max=ns;
+    }
+    void merge(const latency_hist &h) {
+        for(int b=0; b<LAT_BUCKETS; b++)
+            count[b]+=h.count[b];
+        total+=h.total;
+        if(h.max>max)
+            max=h.max;
+    }
+    u_int64_t percentile(double p) {
+        u_int64_t want=(u_int64_t)ceil(p*total), seen=0;
+        for(int b=0; b<LAT_BUCKETS; b++) {
+            seen+=count[b];
+            if(seen>=want && seen>0)
+                return bucket_top(b)<max ? bucket_top(b) : max;
+        }
+        return max;
+    }
+};
+
+static masstree::btree  *tree;
+static workload         wl;
+static int              dist;
+static u_int64_t        records;
+static volatile int     phase;
+static volatile u_int64_t next_id;
+/* ids below this are in the tree; inserts finishing out of order wait
+   for the ones before them, so readers never pick an id still in flight */
+static volatile u_int64_t inserted;
+
+/* zipfian over [0, n) as YCSB draws it, item 0 the most popular */
+static double   zipf_zetan, zipf_alpha, zipf_eta, zipf_half;
+
+static double zeta(u_int64_t n, double theta)
+{
+    double sum=0;
+    for(u_int64_t i=1; i<=n; i++)
+        sum+=1/pow((double)i,theta);
+    return sum;
+}
+
+static void zipf_init(u_int64_t n)
+{
+    double zeta2=zeta(2,ZIPF_THETA);
+    zipf_zetan=zeta(n,ZIPF_THETA);
+    zipf_alpha=1/(1-ZIPF_THETA);
+    zipf_eta=(1-pow(2.0/n,1-ZIPF_THETA))/(1-zeta2/zipf_zetan);
+    zipf_half=1+pow(0.5,ZIPF_THETA);
+}
+
+struct rng {
+    __uint128_t s;
+    u_int64_t next() {
+        s*=0xda942042e4dd58b5;
+        return s>>64;
+    }
+    double unit() {
+        return (next()>>11)*(1.0/9007199254740992.0);
+    }
+};
+
+static u_int64_t zipf_next(rng &r, u_int64_t n)
+{
+    double u=r.unit(), uz=u*zipf_zetan;
+    if(uz<1)
+        return 0;
+    if(uz<zipf_half)
+        return 1;
+    u_int64_t x=(u_int64_t)(n*pow(zipf_eta*u-zipf_eta+1,zipf_alpha));
+    return x<n ? x : n-1;
+}
+
+static u_int64_t fnv64(u_int64_t x)
+{
+    u_int64_t h=0xcbf29ce484222325ULL;
+    for(int i=0; i<8; i++) {
+        h^=(x>>(i*8))&0xff;
+        h*=0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* ids are spread over the key space so popular items are not neighbours,
+   except under the sequential generator, which is there for hot leaves */
+static u_int64_t id_key(u_int64_t id)
+{
+    return dist==DIST_SEQUENTIAL ? id+1 : fnv64(id);
+}
+
+struct thread_state {
+    int         id;
+    int         threads;
+    rng         r;
+    u_int64_t   seq;
+    u_int64_t   found;
+    latency_hist lat[YCSB_OPS][LAT_CLASSES];
+} __attribute__((aligned(64)));
+
+static u_int64_t pick_id(thread_state *t)
+{
+    u_int64_t n=inserted, x;
+    switch(dist) {
+        case DIST_UNIFORM:
+            return t->r.next()%n;
+        case DIST_ZIPFIAN:
+            /* scrambled, so the hot items are not the oldest ones */
+            x=zipf_next(t->r,records);
+            return fnv64(x)%n;
+        case DIST_LATEST:
+            x=zipf_next(t->r,records);
+            return x<n ? n-1-x : 0;
+        default:
+            return (t->seq++)%n;
+    }
+}
+
+static bool scan_count(u_int64_t key, void *value, void *arg)
+{
+    (void)key;
+    (void)value;
+    (*(u_int64_t *)arg)++;
+    return true;
+}
+
+static void* rmw_inc(void *value, void *arg)
+{
+    (void)arg;
+    return SET_IV((value ? IV_GET(value) : 0)+1);
+}
+
+static void* load(void *arg)
+{
+    thread_state *t=(thread_state *)arg;
+    for(u_int64_t i=t->id; i<records; i+=t->threads)
+        tree->insert(id_key(i),SET_IV(i));
+    return NULL;
+}
+
+static u_int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void* run(void *arg)
+{
+    thread_state *t=(thread_state *)arg;
+    masstree::thread_counts before, after;
+    u_int64_t id, n, start=0;
+    int op, p, measured, cls;
+
+    t->seq=t->r.next();
+    while(phase!=PHASE_STOP) {
+        p=t->r.next()%100;
+        for(op=0; p>=wl.mix[op]; op++)
+            p-=wl.mix[op];
+        measured=(phase==PHASE_MEASURE);
+        if(measured) {
+            masstree::thread_stats(before);
+            start=now_ns();
+        }
+        switch(op) {
+            case YCSB_READ:
+                t->found+=(tree->get(id_key(pick_id(t)))!=NULL);
+                break;
+            case YCSB_UPDATE:
+                tree->update(id_key(pick_id(t)),SET_IV(t->r.next()>>8));
+                break;
+            case YCSB_INSERT:
+                id=__sync_fetch_and_add(&next_id,1);
+                tree->insert(id_key(id),SET_IV(id));
+                break;
+            case YCSB_SCAN:
+                n=0;
+                tree->scan(id_key(pick_id(t)),1+t->r.next()%SCAN_MAX,scan_count,&n);
+                t->found+=n;
+                break;
+            case YCSB_RMW:
+                tree->rmw(id_key(pick_id(t)),rmw_inc,NULL);
+                break;
+        }
+        if(measured) {
+            n=now_ns()-start;
+            masstree::thread_stats(after);
+            cls=LAT_PLAIN;
+            if(after.splits!=before.splits)
+                cls=LAT_SPLIT;
+            else if(after.rebalances!=before.rebalances)
+                cls=LAT_REBALANCE;
+            else if(after.retries!=before.retries)
+                cls=LAT_RETRY;
+            else if(after.waits!=before.waits)
+                cls=LAT_WAIT;
+            t->lat[op][cls].record(n);
+        }
+        /* outside the timed part, the wait is on other threads */
+        if(op==YCSB_INSERT)
+            while(!__sync_bool_compare_and_swap(&inserted,id,id+1))
+                sched_yield();
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void sleep_for(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec=(time_t)seconds;
+    ts.tv_nsec=(long)((seconds-ts.tv_sec)*1e9);
+    nanosleep(&ts,NULL);
+}
+
+int main(int argc, char **argv)
+{
+    char name = 'A';
+    int threads = 4;
+    double seconds = 10, warmup = 2;
+    int i, op, c, k;
+
+    records = 1000000;
+    dist = -1;
+    if(argc>1)
+        name = toupper(argv[1][0]);
+    if(argc>2)
+        for(i=0; i<DISTS; i++)
+            if(string(argv[2])==dist_names[i])
+                dist = i;
+    if(argc>3)
+        threads = atoi(argv[3]);
+    if(argc>4)
+        records = atoll(argv[4]);
+    if(argc>5)
+        seconds = atof(argv[5]);
+    if(argc>6)
+        warmup = atof(argv[6]);
+
+    for(i=0; i<6 && workloads[i].name!=name; i++);
+    if(i==6 || threads<1 || records<2 || (argc>2 && dist<0 && string(argv[2])!="-")) {
+        cerr<<"usage: ycsb_bench [A-F] [uniform|zipfian|latest|sequential] "
+              "[threads] [records] [seconds] [warmup]\n";
+        return 1;
+    }
+    wl = workloads[i];
+    if(dist<0)
+        dist = wl.dist;
+
+    tree = new masstree::btree;
+    thread_state *ts = new thread_state[threads]();
+    pthread_t *tid = new pthread_t[threads];
+    srand(time(NULL));
+    for(i=0; i<threads; i++) {
+        ts[i].id = i;
+        ts[i].threads = threads;
+        ts[i].r.s = ((__uint128_t)rand()<<64) | ((u_int64_t)rand()*2+1);
+    }
+
+    double start = now();
+    for(i=0; i<threads; i++)
+        pthread_create(&tid[i],NULL,load,&ts[i]);
+    for(i=0; i<threads; i++)
+        pthread_join(tid[i],NULL);
+    double load_time = now()-start;
+    next_id = records;
+    inserted = records;
+    zipf_init(records);
+
+    cout<<"workload "<<wl.name<<", "<<dist_names[dist]<<", threads: "<<threads
+        <<", records: "<<records<<"\n";
+    cout<<"load: "<<records/load_time/1e6<<"M inserts/s\n";
+
+    phase = PHASE_WARMUP;
+    for(i=0; i<threads; i++)
+        pthread_create(&tid[i],NULL,run,&ts[i]);
+    sleep_for(warmup);
+    phase = PHASE_MEASURE;
+    start = now();
+    sleep_for(seconds);
+    phase = PHASE_STOP;
+    double elapsed = now()-start;
+    for(i=0; i<threads; i++)
+        pthread_join(tid[i],NULL);
+
+    /* lat[op][LAT_CLASSES] takes every class of op */
+    latency_hist (*lat)[LAT_CLASSES+1] = new latency_hist[YCSB_OPS][LAT_CLASSES+1]();
+    u_int64_t total = 0;
+    for(op=0; op<YCSB_OPS; op++) {
+        for(i=0; i<threads; i++)
+            for(c=0; c<LAT_CLASSES; c++)
+                lat[op][c].merge(ts[i].lat[op][c]);
+        for(c=0; c<LAT_CLASSES; c++)
+            lat[op][LAT_CLASSES].merge(lat[op][c]);
+        total += lat[op][LAT_CLASSES].total;
+    }
+    cout<<"run: "<<total/elapsed/1e6<<"M ops/s over "<<elapsed<<"s\n";
+    cout<<"latency (ns)          count      p50      p99    p99.9      max\n";
+    for(op=0; op<YCSB_OPS; op++) {
+        for(k=0; k<=LAT_CLASSES; k++) {
+            c = k ? k-1 : LAT_CLASSES;
+            latency_hist &h = lat[op][c];
+            if(h.total==0)
+                continue;
+            printf("%-7s %-9s %10lu %8lu %8lu %8lu %8lu\n",
+                   c==LAT_CLASSES ? op_names[op] : "", c==LAT_CLASSES ? "all" : lat_names[c],
+                   h.total, h.percentile(0.5), h.percentile(0.99), h.percentile(0.999), h.max);
+        }
+    }
+
+    cout<<"{\"workload\":\""<<wl.name<<"\",\"distribution\":\""<<dist_names[dist]
+        <<"\",\"threads\":"<<threads<<",\"records\":"<<records
+        <<",\"warmup\":"<<warmup<<",\"seconds\":"<<elapsed
+        <<",\"load_ops_per_sec\":"<<(u_int64_t)(records/load_time)
+        <<",\"ops\":"<<total<<",\"ops_per_sec\":"<<(u_int64_t)(total/elapsed);
+    for(op=0; op<YCSB_OPS; op++)
+        if(wl.mix[op])
+            cout<<",\""<<op_names[op]<<"\":"<<lat[op][LAT_CLASSES].total;
+    cout<<",\"latency\":{";
+    for(op=0, i=0; op<YCSB_OPS; op++) {
+        if(!wl.mix[op])
+            continue;
+        cout<<(i++ ? "," : "")<<"\""<<op_names[op]<<"\":{";
+        for(k=0; k<=LAT_CLASSES; k++) {
+            c = k ? k-1 : LAT_CLASSES;
+            latency_hist &h = lat[op][c];
+            cout<<"\""<<(c==LAT_CLASSES ? "all" : lat_names[c])<<"\":{\"count\":"<<h.total
+                <<",\"p50\":"<<h.percentile(0.5)<<",\"p99\":"<<h.percentile(0.99)
+                <<",\"p999\":"<<h.percentile(0.999)<<",\"max\":"<<h.max<<"}"<<(k<LAT_CLASSES ? "," : "");
+        }
+        cout<<"}";
+    }
+    cout<<"}}\n";
+
+    return 0;
+}
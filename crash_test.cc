@@ -0,0 +1,473 @@
+#include <iostream>
+#include <vector>
+#include <map>
+#include <climits>
+#include <time.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+#include "masstree.h"
+
+/* Crash injection for the persistent tree, linked against masstree.cc built
+   with -DCRASH_SIM. Nodes live in a simulated persistent heap that keeps a
+   durable image beside the working memory: a flushed line reaches the image
+   at the next fence. Every flush and every fence is a crash point. At a
+   crash point the process forks; the child swaps the heap for a crash image,
+   runs recover() and checks the tree invariants and every key against the
+   operations that had returned, while the parent carries on. Besides the
+   image of what was fenced, each point gets random images in which dirty
+   and flushed but unfenced lines may or may not have been written back.
+
+   usage: crash_test [keys] [crashes] [seed] [images] [strings]
+   crashes is the number of points sampled, 0 replays all of them; with
+   strings set the keys are strings that share prefixes, so that layers
+   and key suffixes are built and torn down */
+
+#define SIM_HEAP    (64ULL << 20)
+#define SIM_LINE    64
+#define SIM_POISON  0xdb
+#define MAX_REPORTS 20
+
+static __uint128_t g_lehmer64_state;
+
+static uint64_t lehmer64() {
+  g_lehmer64_state *= 0xda942042e4dd58b5;
+  return g_lehmer64_state >> 64;
+}
+
+/* the simulated heap: working memory, durable image and the lines flushed
+   since the last fence; allocations are durable as soon as they return */
+static char *heap, *image;
+static size_t heap_top;
+static map<char *, size_t> blocks;
+static map<size_t, vector<char *> > free_blocks;
+static vector<char *> pending;
+static vector<char> pending_data;
+
+/* crash points */
+static u_int64_t points;
+static vector<u_int64_t> targets;
+static size_t next_target;
+static int images = 1;
+static u_int64_t crashes, failures;
+static map<void *, pair<u_int64_t, u_int64_t> > sites;
+
+/* the workload and what the tree must hold */
+static masstree::btree *tree;
+static vector<u_int64_t> keys;
+static vector<string> skeys;
+static bool strings;
+static vector<char> present;
+static long inflight = -1;
+static long op_index;
+static const char *op_name = "create";
+
+namespace masstree
+{
+    void* sim_malloc(size_t size)
+    {
+        size = (size+SIM_LINE-1) & ~(size_t)(SIM_LINE-1);
+        vector<char *> &list = free_blocks[size];
+        char *ptr;
+        if(!list.empty())
+        {
+            ptr = list.back();
+            list.pop_back();
+        } else
+        {
+            if(heap_top+size>SIM_HEAP)
+            {
+                fprintf(stderr,"simulated heap exhausted\n");
+                abort();
+            }
+            ptr = heap+heap_top;
+            heap_top += size;
+        }
+        blocks[ptr] = size;
+        return ptr;
+    }
+
+    void sim_free(void *ptr)
+    {
+        map<char *, size_t>::iterator it = blocks.find((char *)ptr);
+        if(it==blocks.end())
+        {
+            fprintf(stderr,"sim_free of %p, which is not allocated\n",ptr);
+            abort();
+        }
+        free_blocks[it->second].push_back(it->first);
+        blocks.erase(it);
+    }
+}
+
+static void crash(void *site, const char *kind);
+
+static void crash_point(void *site, const char *kind)
+{
+    if(next_target<targets.size() && targets[next_target]==points)
+    {
+        next_target++;
+        crash(site,kind);
+    }
+    points++;
+}
+
+namespace masstree
+{
+    void sim_flush(void *line, void *site)
+    {
+        crash_point(site,"flush");
+        if((char *)line<heap || (char *)line>=heap+heap_top)
+            return;
+        pending.push_back((char *)line);
+        pending_data.insert(pending_data.end(),(char *)line,(char *)line+SIM_LINE);
+    }
+
+    void sim_fence(void *site)
+    {
+        crash_point(site,"fence");
+        for(size_t i=0; i<pending.size(); i++)
+            memcpy(image+(pending[i]-heap),&pending_data[i*SIM_LINE],SIM_LINE);
+        pending.clear();
+        pending_data.clear();
+    }
+}
+
+/* values are the caller's to persist, they do not take part in the crash */
+static void persist(void *ptr, size_t len)
+{
+    size_t off = (char *)ptr-heap;
+    memcpy(image+off,heap+off,len);
+}
+
+static void sim_reset()
+{
+    memset(heap,0,heap_top);
+    memset(image,0,heap_top);
+    heap_top = 0;
+    blocks.clear();
+    free_blocks.clear();
+    pending.clear();
+    pending_data.clear();
+    points = 0;
+    next_target = 0;
+}
+
+static void site_name(void *site, char *buf, size_t len)
+{
+    Dl_info info;
+    if(dladdr(site,&info) && info.dli_sname)
+    {
+        int status;
+        char *name = abi::__cxa_demangle(info.dli_sname,NULL,NULL,&status);
+        snprintf(buf,len,"%s+0x%lx",status==0 ? name : info.dli_sname,
+                 (unsigned long)((char *)site-(char *)info.dli_saddr));
+        free(name);
+    } else
+        snprintf(buf,len,"%p",site);
+}
+
+/* turns the heap into what a crash could have left: image 0 holds only
+   what was fenced, the others take each unsettled line from the image,
+   the working memory or its pending flush at random */
+static void crash_image(int n)
+{
+    if(n==0)
+        memcpy(heap,image,heap_top);
+    else
+    {
+        map<size_t, size_t> flushed;
+        for(size_t i=0; i<pending.size(); i++)
+            flushed[pending[i]-heap] = i;
+        g_lehmer64_state = (points<<8) ^ n ^ 0x9e3779b97f4a7c15ULL;
+        for(size_t off=0; off<heap_top; off+=SIM_LINE)
+        {
+            map<size_t, size_t>::iterator it = flushed.find(off);
+            int choices = it==flushed.end() ? 2 : 3;
+            if(it==flushed.end() && memcmp(heap+off,image+off,SIM_LINE)==0)
+                continue;
+            switch(lehmer64()%choices)
+            {
+                case 0:
+                    memcpy(heap+off,image+off,SIM_LINE);
+                    break;
+                case 2:
+                    memcpy(heap+off,&pending_data[it->second*SIM_LINE],SIM_LINE);
+                    break;
+            }
+        }
+    }
+    /* freed memory may have been handed out again */
+    for(map<size_t, vector<char *> >::iterator it=free_blocks.begin(); it!=free_blocks.end(); ++it)
+        for(size_t i=0; i<it->second.size(); i++)
+            memset(it->second[i],SIM_POISON,it->first);
+}
+
+static void *get(size_t i)
+{
+    return strings ? tree->get(skeys[i]) : tree->get(keys[i]);
+}
+
+static bool collect(string_view key, void *value, void *arg)
+{
+    ((vector<pair<string, void *> > *)arg)->push_back(make_pair(string(key),value));
+    return true;
+}
+
+/* string keys have no reverse scan */
+static bool check_strings(u_int64_t found)
+{
+    vector<pair<string, void *> > all;
+
+    tree->scan("",INT_MAX,collect,&all);
+    for(size_t i=0; i<all.size(); i++)
+        if((i>0 && all[i].first<=all[i-1].first) || tree->get(all[i].first)!=all[i].second)
+        {
+            fprintf(stderr,"scan returns %s out of order or with a stale value\n",all[i].first.c_str());
+            return false;
+        }
+    if(all.size()!=found)
+    {
+        fprintf(stderr,"scan finds %lu keys, lookups %lu\n",all.size(),found);
+        return false;
+    }
+    return true;
+}
+
+static bool check_keys()
+{
+    u_int64_t found = 0, scanned = 0, prev = 0;
+
+    for(size_t i=0; i<keys.size(); i++)
+    {
+        void *value = get(i);
+        if(value!=NULL && *(u_int64_t *)value!=keys[i])
+        {
+            fprintf(stderr,"key %lx has a wrong value\n",keys[i]);
+            return false;
+        }
+        if((long)i!=inflight && (value!=NULL)!=(bool)present[i])
+        {
+            fprintf(stderr,"key %lx is %s\n",keys[i],present[i] ? "lost" : "back after its remove");
+            return false;
+        }
+        found += value!=NULL;
+    }
+    if(strings)
+        return check_strings(found);
+    for(masstree::btree::iterator it=tree->begin(); it.valid(); ++it, scanned++)
+    {
+        if((scanned>0 && it.key()<=prev) || tree->get(it.key())!=it.value())
+        {
+            fprintf(stderr,"scan returns %lx out of order or with a stale value\n",it.key());
+            return false;
+        }
+        prev = it.key();
+    }
+    if(scanned!=found)
+    {
+        fprintf(stderr,"scan finds %lu keys, lookups %lu\n",scanned,found);
+        return false;
+    }
+    scanned = 0;
+    for(masstree::btree::reverse_iterator it=tree->rbegin(); it.valid(); ++it, scanned++)
+    {
+        if((scanned>0 && it.key()>=prev) || tree->get(it.key())!=it.value())
+        {
+            fprintf(stderr,"reverse scan returns %lx out of order or with a stale value\n",it.key());
+            return false;
+        }
+        prev = it.key();
+    }
+    if(scanned!=found)
+    {
+        fprintf(stderr,"reverse scan finds %lu keys, lookups %lu\n",scanned,found);
+        return false;
+    }
+    return true;
+}
+
+static void toggle(size_t i)
+{
+    inflight = i;
+    if(present[i])
+    {
+        op_name = "remove";
+        if(strings)
+            tree->remove(skeys[i]);
+        else
+            tree->remove(keys[i]);
+    } else
+    {
+        op_name = "insert";
+        u_int64_t *value = (u_int64_t *)masstree::sim_malloc(sizeof(u_int64_t));
+        *value = keys[i];
+        persist(value,sizeof(u_int64_t));
+        if(!(strings ? tree->insert(skeys[i],value) : tree->insert(keys[i],value)))
+            masstree::sim_free(value);
+    }
+    present[i] = !present[i];
+    inflight = -1;
+    op_index++;
+}
+
+/* runs in the child on the crash image */
+static int replay()
+{
+    targets.clear();
+    alarm(10);
+    tree->recover();
+    if(!tree->verify() || !check_keys())
+        return 1;
+
+    /* the recovered tree must take further work */
+    if(inflight>=0)
+        present[inflight] = get(inflight)!=NULL;
+    inflight = -1;
+    for(size_t i=0; i<keys.size(); i+=3)
+        toggle(i);
+    if(!tree->verify() || !check_keys())
+    {
+        fprintf(stderr,"after more operations on the recovered tree\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void crash(void *site, const char *kind)
+{
+    if(tree==NULL)
+        return;
+    for(int n=0; n<=images; n++)
+    {
+        int status;
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid==0)
+        {
+            crash_image(n);
+            _exit(replay());
+        }
+        waitpid(pid,&status,0);
+        crashes++;
+        sites[site].first++;
+        if(WIFEXITED(status) && WEXITSTATUS(status)==0)
+            continue;
+        failures++;
+        sites[site].second++;
+        if(failures<=MAX_REPORTS)
+        {
+            char name[256];
+            site_name(site,name,sizeof(name));
+            printf("FAILED at point %lu, image %d: %s in %s during op %ld (%s %lx)",
+                   points,n,kind,name,op_index,op_name,inflight<0 ? 0 : keys[inflight]);
+            if(WIFSIGNALED(status))
+                printf(", killed by signal %d",WTERMSIG(status));
+            printf("\n");
+        }
+    }
+}
+
+/* inserts every key, toggles random ones, then removes what is left */
+static void run(u_int64_t seed)
+{
+    size_t n = keys.size();
+    vector<size_t> order(n);
+
+    g_lehmer64_state = seed;
+    present.assign(n,0);
+    op_index = 0;
+    op_name = "create";
+    tree = NULL;
+    tree = new masstree::btree;
+
+    for(size_t i=0; i<n; i++)
+        order[i] = i;
+    for(size_t i=n-1; i>0; i--)
+        swap(order[i],order[lehmer64()%(i+1)]);
+    for(size_t i=0; i<n; i++)
+        toggle(order[i]);
+    for(size_t i=0; i<n; i++)
+        toggle(lehmer64()%n);
+    for(size_t i=n-1; i>0; i--)
+        swap(order[i],order[lehmer64()%(i+1)]);
+    for(size_t i=0; i<n; i++)
+        if(present[order[i]])
+            toggle(order[i]);
+}
+
+int main(int argc, char **argv)
+{
+    int num_keys = 1000;
+    u_int64_t num_crashes = 0;
+    u_int64_t seed = time(NULL);
+    if(argc>1)
+        num_keys = atoi(argv[1]);
+    if(argc>2)
+        num_crashes = atoll(argv[2]);
+    if(argc>3)
+        seed = atoll(argv[3]);
+    if(argc>4)
+        images = atoi(argv[4]);
+    if(argc>5)
+        strings = atoi(argv[5]);
+
+    heap = (char *)mmap(NULL,SIM_HEAP,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    image = (char *)mmap(NULL,SIM_HEAP,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if(heap==MAP_FAILED || image==MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    g_lehmer64_state = seed|1;
+    for(int i=0; i<num_keys; i++)
+        keys.push_back(lehmer64());
+    for(int i=0; i<num_keys; i++)
+    {
+        static const char *prefix[] = {"", "p/", "path/to/", "path/to/some/deeper/"};
+        char hex[24];
+        snprintf(hex,sizeof(hex),"%016lx",keys[i]);
+        skeys.push_back(keys[i]%5==0 ? to_string(i) : string(prefix[keys[i]%4])+hex);
+    }
+
+    /* a clean run counts the points and checks the tree without crashes */
+    run(seed|1);
+    if(!tree->verify() || !check_keys())
+    {
+        printf("the tree is broken without a crash (seed %lu)\n",seed);
+        return 1;
+    }
+    u_int64_t total = points;
+
+    g_lehmer64_state = seed^0x5bd1e995;
+    if(num_crashes==0 || num_crashes>=total)
+        for(u_int64_t p=0; p<total; p++)
+            targets.push_back(p);
+    else
+    {
+        for(u_int64_t i=0; i<num_crashes; i++)
+            targets.push_back(lehmer64()%total);
+        sort(targets.begin(),targets.end());
+        targets.erase(unique(targets.begin(),targets.end()),targets.end());
+    }
+    cout<<"keys: "<<num_keys<<", seed: "<<seed<<", crash points: "<<total
+        <<", replaying "<<targets.size()<<" with "<<images+1<<" images each\n";
+
+    sim_reset();
+    run(seed|1);
+
+    cout<<"crashes: "<<crashes<<", failures: "<<failures<<"\n";
+    for(map<void *, pair<u_int64_t, u_int64_t> >::iterator it=sites.begin(); it!=sites.end(); ++it)
+    {
+        char name[256];
+        site_name(it->first,name,sizeof(name));
+        printf("  %-60s %8lu crashes %8lu failed\n",name,it->second.first,it->second.second);
+    }
+    return failures!=0;
+}
@@ -36,7 +36,7 @@ int main()
     {
         key=lehmer64();
         //key+=100;
-        val=malloc(4);
+        val=SET_IV(i);
         inserts+=tree.insert(key,val);
         keys[i]=key;
         tot++;
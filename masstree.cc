@@ -1,5 +1,13 @@
 #include "masstree.h"
 
+#ifdef CRASH_SIM
+#define RRP_free sim_free
+#define RRP_malloc sim_malloc
+#else
+#define RRP_free free
+#define RRP_malloc malloc
+#endif
+
 namespace masstree
 {
     static constexpr uint64_t CACHE_LINE_SIZE = 64;
@@ -14,22 +22,110 @@ namespace masstree
         asm volatile("sfence":::"memory");
     }
 
-    static inline void clflush(char *data, int len, bool front, bool back)
+    /* cache line write back, picked at startup like the search kernels */
+    static flush_isa detect_flush_isa()
     {
-        volatile char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
-        if (front)
-            mfence();
-        for(; ptr<data+len; ptr+=CACHE_LINE_SIZE){
-    #ifdef CLFLUSH
-            asm volatile("clflush %0" : "+m" (*(volatile char *)ptr));
-    #elif CLFLUSH_OPT
-            asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)(ptr)));
-    #elif CLWB
-            asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)(ptr)));
-    #endif
-        }
-        if (back)
+        unsigned int a, b, c, d;
+        if(__get_cpuid_count(7,0,&a,&b,&c,&d))
+        {
+            if(b & bit_CLWB)
+                return FLUSH_CLWB;
+            if(b & bit_CLFLUSHOPT)
+                return FLUSH_CLFLUSHOPT;
+        }
+        return FLUSH_CLFLUSH;
+    }
+
+    static flush_isa max_flush = detect_flush_isa();
+    static flush_isa active_flush = max_flush;
+
+    flush_isa get_flush_isa()
+    {
+        return active_flush;
+    }
+
+    bool set_flush_isa(flush_isa isa)
+    {
+        if(isa>max_flush)
+            return false;
+        active_flush=isa;
+        return true;
+    }
+
+    static inline void write_back(char *line)
+    {
+        switch(active_flush)
+        {
+            case FLUSH_CLWB:
+                asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*(volatile char *)line));
+                break;
+            case FLUSH_CLFLUSHOPT:
+                asm volatile(".byte 0x66; clflush %0" : "+m" (*(volatile char *)line));
+                break;
+            case FLUSH_CLFLUSH:
+                asm volatile("clflush %0" : "+m" (*(volatile char *)line));
+                break;
+            default:
+                break;
+        }
+    }
+
+    /* Persistence ordering. persist() only records the cache lines a store
+       touched, once each; persist_fence() writes the recorded lines back
+       and fences once. Writers fence only where a later store must not
+       become durable before an earlier one, and before memory is freed.
+       recover() rebuilds the inner levels, the parent pointers and the left
+       links, so their stores need no ordering of their own. */
+    static thread_local struct
+    {
+        char    *line[FLUSH_SET];
+        int     n;
+        bool    unfenced;
+    } flush_set;
+
+    /* out of line so that under CRASH_SIM the return address names the
+       writer that persists */
+    __attribute__((noinline)) static void flush_set_drain(bool fence)
+    {
+#ifdef CRASH_SIM
+        void *site = __builtin_return_address(0);
+        for(int i=0; i<flush_set.n; i++)
+            sim_flush(flush_set.line[i],site);
+        if(fence)
+            sim_fence(site);
+#else
+        for(int i=0; i<flush_set.n; i++)
+            write_back(flush_set.line[i]);
+        if(fence)
             mfence();
+#endif
+        flush_set.n = 0;
+        flush_set.unfenced = !fence;
+    }
+
+    __attribute__((always_inline)) static inline void persist(void *data, int len)
+    {
+#ifndef CRASH_SIM
+        if(active_flush==FLUSH_NONE)
+            return;
+#endif
+        char *ptr = (char *)((unsigned long)data &~(CACHE_LINE_SIZE-1));
+        for(; ptr<(char *)data+len; ptr+=CACHE_LINE_SIZE)
+        {
+            int i;
+            for(i=0; i<flush_set.n && flush_set.line[i]!=ptr; i++);
+            if(i<flush_set.n)
+                continue;
+            if(flush_set.n==FLUSH_SET)
+                flush_set_drain(false);
+            flush_set.line[flush_set.n++] = ptr;
+        }
+    }
+
+    __attribute__((always_inline)) static inline void persist_fence()
+    {
+        if(flush_set.n>0 || flush_set.unfenced)
+            flush_set_drain(true);
     }
 
     static inline void movnt64(uint64_t *dest, uint64_t const &src, bool front, bool back) {
@@ -39,12 +135,181 @@ namespace masstree
         if (back) mfence();
     }
 
+#ifdef SPLIT_KV
+    __attribute__((always_inline)) static inline void persist_entry(kv_ref e)
+    {
+        persist(&e.key, sizeof(u_int64_t));
+        persist(&e.link_or_value, sizeof(void *));
+    }
+#else
+    __attribute__((always_inline)) static inline void persist_entry(kv &e)
+    {
+        persist(&e, sizeof(kv));
+    }
+#endif
+
     static inline void prefetch_(const void *ptr)
     {
         typedef struct { char x[CACHE_LINE_SIZE]; } cacheline_t;
         asm volatile("prefetcht0 %0" : : "m" (*(const cacheline_t *)ptr));
     }
 
+    uint64_t lock_version=100;
+
+    /* The search kernels compare the probe against every physical slot of a
+       node at once. With SPLIT_KV the slot keys are contiguous, otherwise kv
+       is {key, link_or_value} and they sit at the even u_int64_t offsets of
+       the entry array. The compares give a mask, in
+       slot order, of the keys below the probe; shuffling it by the permutation
+       puts it in sorted order, where it is a prefix whose length is the rank.
+       Free slots sort past size() and are masked off, so neither a branch nor
+       a loop over the permutation is needed. */
+
+    __attribute__((target("sse4.2")))
+    static inline int rank_sse42(uint64_t perm, uint32_t lt, uint32_t eq, int &eqp)
+    {
+        /* one byte per permutation element, element i in byte i */
+        __m128i v = _mm_cvtsi64_si128(perm>>4);
+        __m128i order = _mm_unpacklo_epi8(_mm_and_si128(v,_mm_set1_epi8(0x0f)),
+                                          _mm_and_si128(_mm_srli_epi64(v,4),_mm_set1_epi8(0x0f)));
+        /* one byte per slot, 0xff where the slot key is below the probe */
+        const __m128i bits = _mm_set1_epi64x(0x8040201008040201LL);
+        __m128i m = _mm_shuffle_epi8(_mm_cvtsi32_si128(lt), _mm_set_epi8(1,1,1,1,1,1,1,1,0,0,0,0,0,0,0,0));
+        m = _mm_cmpeq_epi8(_mm_and_si128(m,bits),bits);
+        int n = permuter::size(perm);
+        int rank = __builtin_popcount(_mm_movemask_epi8(_mm_shuffle_epi8(m,order)) & ((1<<n)-1));
+        eqp = -1;
+        if(rank<n) {
+            /* rank==LEAF_WIDTH would shift perm by 64 */
+            int p = (perm>>((rank<<2)+4)) & LEAF_WIDTH;
+            if((eq>>p)&1)
+                eqp = p;
+        }
+        return rank;
+    }
+
+#ifdef SPLIT_KV
+    __attribute__((target("sse4.2")))
+    static int simd_rank_sse42(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        /* pcmpgtq is signed, flipping the sign bit gives the unsigned order */
+        const __m128i flip = _mm_set1_epi64x(0x8000000000000000LL);
+        const __m128i k = _mm_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        /* the 16th lane reads link_or_value[0] and is masked off below */
+        for(int i=0; i<=LEAF_WIDTH; i+=2)
+        {
+            __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(slots+i)),flip);
+            lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(k,s))) << i;
+        }
+        return rank_sse42(perm,lt&((1<<LEAF_WIDTH)-1),eq&((1<<LEAF_WIDTH)-1),eqp);
+    }
+
+    __attribute__((target("avx2")))
+    static int simd_rank_avx2(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        const __m256i flip = _mm256_set1_epi64x(0x8000000000000000LL);
+        const __m256i k = _mm256_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<=LEAF_WIDTH; i+=4)
+        {
+            __m256i s = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(slots+i)),flip);
+            lt |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k,s))) << i;
+        }
+        return rank_sse42(perm,lt&((1<<LEAF_WIDTH)-1),eq&((1<<LEAF_WIDTH)-1),eqp);
+    }
+#else
+    __attribute__((target("sse4.2")))
+    static int simd_rank_sse42(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        /* pcmpgtq is signed, flipping the sign bit gives the unsigned order */
+        const __m128i flip = _mm_set1_epi64x(0x8000000000000000LL);
+        const __m128i k = _mm_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<LEAF_WIDTH-1; i+=2)
+        {
+            __m128i s = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)(slots+(i<<1))),
+                                           _mm_loadu_si128((const __m128i *)(slots+(i<<1)+2)));
+            s = _mm_xor_si128(s,flip);
+            lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(k,s))) << i;
+        }
+        lt |= (uint32_t)(slots[(LEAF_WIDTH-1)<<1]<key) << (LEAF_WIDTH-1);
+        eq |= (uint32_t)(slots[(LEAF_WIDTH-1)<<1]==key) << (LEAF_WIDTH-1);
+        return rank_sse42(perm,lt,eq,eqp);
+    }
+
+    __attribute__((target("avx2")))
+    static int simd_rank_avx2(const u_int64_t *slots, uint64_t perm, uint64_t key, int &eqp)
+    {
+        const __m256i flip = _mm256_set1_epi64x(0x8000000000000000LL);
+        const __m256i k = _mm256_set1_epi64x(key^0x8000000000000000ULL);
+        uint32_t lt=0, eq=0;
+        for(int i=0; i<12; i+=4)
+        {
+            /* unpacklo gives keys i, i+2, i+1, i+3; restore slot order */
+            __m256i s = _mm256_unpacklo_epi64(_mm256_loadu_si256((const __m256i *)(slots+(i<<1))),
+                                              _mm256_loadu_si256((const __m256i *)(slots+(i<<1)+4)));
+            s = _mm256_xor_si256(_mm256_permute4x64_epi64(s,_MM_SHUFFLE(3,1,2,0)),flip);
+            lt |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,s))) << i;
+            eq |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(k,s))) << i;
+        }
+        __m128i s = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)(slots+24)),
+                                       _mm_loadu_si128((const __m128i *)(slots+26)));
+        s = _mm_xor_si128(s,_mm256_castsi256_si128(flip));
+        lt |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm256_castsi256_si128(k),s))) << 12;
+        eq |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(_mm256_castsi256_si128(k),s))) << 12;
+        lt |= (uint32_t)(slots[28]<key) << 14;
+        eq |= (uint32_t)(slots[28]==key) << 14;
+        return rank_sse42(perm,lt,eq,eqp);
+    }
+#endif
+
+    static search_isa detect_search_isa()
+    {
+#ifdef SIMD_SEARCH
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+            return SEARCH_AVX2;
+        if(__builtin_cpu_supports("sse4.2"))
+            return SEARCH_SSE42;
+#endif
+        return SEARCH_SCALAR;
+    }
+
+    static search_isa max_isa = detect_search_isa();
+    static search_isa active_isa = max_isa;
+
+    search_isa get_search_isa()
+    {
+        return active_isa;
+    }
+
+    bool set_search_isa(search_isa isa)
+    {
+        if(isa>max_isa)
+            return false;
+        active_isa=isa;
+        return true;
+    }
+
+    /* rank of key among the live slots, eqp is the slot holding key or -1 */
+#ifdef SPLIT_KV
+    static inline int simd_rank(kv_array &entry, permuter perm, uint64_t key, int &eqp)
+    {
+        const u_int64_t *slots = entry.key;
+#else
+    static inline int simd_rank(const kv *entry, permuter perm, uint64_t key, int &eqp)
+    {
+        const u_int64_t *slots = reinterpret_cast<const u_int64_t *>(entry);
+#endif
+        if(active_isa==SEARCH_AVX2)
+            return simd_rank_avx2(slots,perm.value(),key,eqp);
+        return simd_rank_sse42(slots,perm.value(),key,eqp);
+    }
+
 
     int inner_node::size()
     {
@@ -79,6 +344,15 @@ namespace masstree
     key_indexed_position leaf_node::key_lower_bound_by(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return l < LEAF_WIDTH ? key_indexed_position(l,perm[l]) : key_indexed_position(l,-1);
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -97,6 +371,15 @@ namespace masstree
     key_indexed_position leaf_node::key_lower_bound(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return (l-1 < 0 ? key_indexed_position(l-1, -1) : key_indexed_position(l-1, perm[l-1]));
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -116,6 +399,15 @@ namespace masstree
     key_indexed_position inner_node::key_lower_bound_by(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return l < LEAF_WIDTH ? key_indexed_position(l,perm[l]) : key_indexed_position(l,-1);
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -134,6 +426,15 @@ namespace masstree
     key_indexed_position inner_node::key_lower_bound(uint64_t key)
     {
         permuter perm = permutation;
+#ifdef SIMD_SEARCH
+        if(active_isa!=SEARCH_SCALAR)
+        {
+            int eqp, l = simd_rank(entry,perm,key,eqp);
+            if(eqp>=0)
+                return key_indexed_position(l, eqp);
+            return (l-1 < 0 ? key_indexed_position(l-1, -1) : key_indexed_position(l-1, perm[l-1]));
+        }
+#endif
         int l = 0, r = perm.size();
         while (l < r) {
             int m = (l + r) >> 1;
@@ -150,7 +451,7 @@ namespace masstree
         return (l-1 < 0 ? key_indexed_position(l-1, -1) : key_indexed_position(l-1, perm[l-1]));
     }
 
-    void leaf_node::insert(uint64_t key, void *value)
+    void leaf_node::insert(uint64_t key, void *value, std::string_view suffix)
     {
         permuter temp = permutation.value();
         key_indexed_position ip = key_lower_bound_by(key);
@@ -160,8 +461,14 @@ namespace masstree
 
         entry[pos].link_or_value=value;
         entry[pos].key=key;
+        persist_entry(entry[pos]);
+        if(!suffix.empty())
+            set_suffix(pos,suffix);
+        persist_fence();
 
         permutation = temp.value();
+        persist(&permutation, sizeof(permuter));
+        persist_fence();
 
         space=(space*num_nodes+1.0/capacity())/num_nodes;
     }
@@ -176,8 +483,12 @@ namespace masstree
 
         entry[pos].link_or_value=value;
         entry[pos].key=key;
+        persist_entry(entry[pos]);
+        persist_fence();
 
         permutation = temp.value();
+        persist(&permutation, sizeof(permuter));
+        persist_fence();
 
         inner_node **value_par;
         value_par = reinterpret_cast<inner_node **>(value);
@@ -196,8 +507,11 @@ namespace masstree
         {
             temp.remove(ip.i);
             permutation = temp.value();
-            clflush((char *)&permutation, sizeof(permuter), false, true);
-            free(entry[ip.p].link_or_value);
+            persist(&permutation, sizeof(permuter));
+            persist_fence();
+            /* a layer is freed by the string remove that empties it */
+            if(!IS_LV(entry[ip.p].link_or_value) && !IS_IV(entry[ip.p].link_or_value))
+                RRP_free(entry[ip.p].link_or_value);
             return 1;
         } 
         return 0;
@@ -222,38 +536,63 @@ namespace masstree
             if(temp.size()==0)
             {
                 child0=NULL;
-                clflush((char *)&child0, sizeof(void *), false, true);
-                free(snap);
+                persist(&child0, sizeof(void *));
+                persist_fence();
+                RRP_free(snap);
                 return 1;
             }
             child0 = entry[ip.p].link_or_value;
-            clflush((char *)&child0, sizeof(void *), false, true);
+            persist(&child0, sizeof(void *));
             temp.remove(0);
             permutation = temp.value();
-            clflush((char *)&permutation, sizeof(permuter), false, true);
-            free(snap);
+            persist(&permutation, sizeof(permuter));
+            persist_fence();
+            RRP_free(snap);
+        } else if(ip.i<temp.size())
+        {
+            /* the right neighbour takes the range over: both entries point
+               to it for a moment, then the separator goes */
+            void *snap = entry[temp[ip.i-1]].link_or_value;
+            entry[temp[ip.i-1]].link_or_value = entry[temp[ip.i]].link_or_value;
+            persist(&entry[temp[ip.i-1]].link_or_value, sizeof(void *));
+            temp.remove(ip.i);
+            permutation = temp.value();
+            persist(&permutation, sizeof(permuter));
+            persist_fence();
+            RRP_free(snap);
         } else 
         {
+            /* the last child has no right neighbour here, so the left one
+               grows up to highest along its rightmost path */
             void *snap = entry[temp[ip.i-1]].link_or_value;
+            inner_node *n = reinterpret_cast<inner_node *>(ip.i>1 ? entry[temp[ip.i-2]].link_or_value : child0);
+            for(;;)
+            {
+                n->highest = highest;
+                persist(&n->highest, sizeof(u_int64_t));
+                if(n->level_==0)
+                    break;
+                permuter np = n->permutation.value();
+                n = reinterpret_cast<inner_node *>(np.size()>0 ? n->entry[np[np.size()-1]].link_or_value : n->child0);
+            }
             temp.remove(ip.i-1);
             permutation = temp.value();
-            clflush((char *)&permutation, sizeof(permuter), false, true);
-            free(snap);
+            persist(&permutation, sizeof(permuter));
+            persist_fence();
+            RRP_free(snap);
         }
         return 1;
     }
 
+    /* fenced by the parent's remove, before this node is freed */
     void leaf_node::del()
     {
         if(right)
-        {
             right->left=left;
-            clflush((char *)&right->left, sizeof(leaf_node *), false, true);
-        }
         if(left)
         {
             left->right=right;
-            clflush((char *)&left->right, sizeof(leaf_node *), false, true);
+            persist(&left->right, sizeof(leaf_node *));
         }
     }
 
@@ -262,12 +601,12 @@ namespace masstree
         if(right)
         {
             right->left=left;
-            clflush((char *)&right->left, sizeof(inner_node *), false, true);
+            persist(&right->left, sizeof(inner_node *));
         }
         if(left)
         {
             left->right=right;
-            clflush((char *)&left->right, sizeof(inner_node *), false, true);
+            persist(&left->right, sizeof(inner_node *));
         }
     }
 
@@ -292,6 +631,96 @@ namespace masstree
         return NULL;
     }
 
+    int leaf_node::find(u_int64_t key)
+    {
+        key_indexed_position ip=key_lower_bound(key);
+        if(ip.i<0 || compare_key(entry[ip.p].key,key)!=0)
+            return -1;
+        return ip.p;
+    }
+
+    /* a single aligned word, so recovery finds the old value or the new one */
+    void leaf_node::update(int slot, void *value)
+    {
+        void *old = entry[slot].link_or_value;
+        entry[slot].link_or_value = value;
+        persist(&entry[slot].link_or_value, sizeof(void *));
+        persist_fence();
+        if(old!=value && !IS_IV(old))
+            RRP_free(old);
+    }
+
+    /* only a string key that goes on past its slice without a layer has a
+       suffix, and only leaves of string keys have a block */
+    bool leaf_node::has_suffix(int slot)
+    {
+        return ksuf!=NULL && SLICE_LEN(entry[slot].key)>KEY_SLICE && !IS_LV(entry[slot].link_or_value);
+    }
+
+    /* the stores are left for the caller's fence, which comes before the
+       permutation makes the slot live */
+    void leaf_node::set_suffix(int slot, std::string_view suffix)
+    {
+        if(ksuf==NULL || ksuf->capacity-ksuf->used<suffix.size())
+        {
+            /* slots not live yet may hold suffixes already, so every slot
+               that looks like one is kept */
+            u_int32_t need = suffix.size(), cap = KSUF_SIZE;
+            for(int i=0; i<LEAF_WIDTH; i++)
+                if(i!=slot && has_suffix(i))
+                    need += ksuf->len[i];
+            while(cap<2*need)
+                cap *= 2;
+            ksuf_block *b = reinterpret_cast<ksuf_block *>(RRP_malloc(sizeof(ksuf_block)+cap));
+            memset(b,0,sizeof(ksuf_block));
+            b->capacity = cap;
+            for(int i=0; i<LEAF_WIDTH; i++)
+                if(i!=slot && has_suffix(i))
+                {
+                    memcpy(b->data+b->used,ksuf->data+ksuf->off[i],ksuf->len[i]);
+                    b->off[i] = b->used;
+                    b->len[i] = ksuf->len[i];
+                    b->used += ksuf->len[i];
+                }
+            persist(b, sizeof(ksuf_block)+b->used);
+            persist_fence();
+
+            ksuf_block *old = ksuf;
+            ksuf = b;
+            persist(&ksuf, sizeof(ksuf_block *));
+            persist_fence();
+            if(old)
+                RRP_free(old);
+        }
+        memcpy(ksuf->data+ksuf->used,suffix.data(),suffix.size());
+        persist(ksuf->data+ksuf->used, suffix.size());
+        ksuf->off[slot] = ksuf->used;
+        ksuf->len[slot] = suffix.size();
+        persist(&ksuf->off[slot], sizeof(u_int32_t));
+        persist(&ksuf->len[slot], sizeof(u_int32_t));
+        ksuf->used += suffix.size();
+        persist(&ksuf->used, sizeof(u_int32_t));
+    }
+
+    void leaf_node::copy_entry(int slot, leaf_node *from, int from_slot)
+    {
+        entry[slot]=from->entry[from_slot];
+        if(from->has_suffix(from_slot))
+            set_suffix(slot,from->suffix(from_slot));
+    }
+
+    /* frees the block of a leaf that holds no keys any more */
+    void leaf_node::drop_ksuf()
+    {
+        ksuf_block *old = ksuf;
+        if(old==NULL)
+            return;
+        ksuf = NULL;
+        persist(&ksuf, sizeof(ksuf_block *));
+        persist_fence();
+        RRP_free(old);
+    }
+
     void* inner_node::get(u_int64_t key)
     {
         key_indexed_position ip=key_lower_bound(key);  
@@ -316,7 +745,7 @@ namespace masstree
         return entry[permutation[ip.i-1]].link_or_value;
     }
 
-    kv leaf_node::split(u_int64_t key, void *value)
+    kv leaf_node::split(u_int64_t key, void *value, std::string_view suffix)
     {
         int mid=size()+1;
         mid/=2;
@@ -333,26 +762,31 @@ namespace masstree
         nr->highest=highest;
 
         for(int i=mid; i<size(); i++)
-            nr->entry[temp[i]]=entry[temp[i]];
+            nr->copy_entry(temp[i],this,temp[i]);
         
-        clflush((char *)nr, sizeof(leaf_node), false, true);
+        /* nr is durable before anything points to it */
+        persist(nr, sizeof(leaf_node));
+        persist_fence();
         
         highest=entry[temp[mid]].key;
-        clflush((char *)&highest, sizeof(u_int64_t), false, true);
+        persist(&highest, sizeof(u_int64_t));
         right=nr;
-        clflush((char *)&right, sizeof(leaf_node *), false, true);
+        persist(&right, sizeof(leaf_node *));
         if(nr->right)
-        {
             nr->right->left=nr;
-            clflush((char *)&nr->right->left, sizeof(leaf_node *), false, true);
-        }
+        /* the chain reaches nr before this leaf lets go of its keys */
+        persist_fence();
         permutation.set_size(mid);
-        clflush((char *)&permutation, sizeof(permuter), false, true);
+        persist(&permutation, sizeof(permuter));
 
         if(compare_key(key,highest)<0)
-            insert(key,value);
+        {
+            /* the released slots get reused */
+            persist_fence();
+            insert(key,value,suffix);
+        }
         else 
-            nr->insert(key,value);
+            nr->insert(key,value,suffix);
 
         return kv(highest,reinterpret_cast<void *>(nr));
     }
@@ -377,26 +811,26 @@ namespace masstree
         for(int i=mid; i<temp.size(); i++)
             nr->entry[temp[i]]=entry[temp[i]];
         
-        clflush((char *)nr, sizeof(inner_node), false, true);
+        persist(nr, sizeof(inner_node));
+        persist_fence();
 
         highest=entry[temp[mid-1]].key;
-        clflush((char *)&highest, sizeof(u_int64_t), false, true);
+        persist(&highest, sizeof(u_int64_t));
         right=nr;
-        clflush((char *)&right, sizeof(inner_node *), false, true);
+        persist(&right, sizeof(inner_node *));
         if(nr->right)
         {
             nr->right->left=nr;
-            clflush((char *)&nr->right->left, sizeof(inner_node *), false, true);
+            persist(&nr->right->left, sizeof(inner_node *));
         }
         permutation.set_size(mid-1);
-        clflush((char *)&permutation, sizeof(permuter), false, true);
+        persist(&permutation, sizeof(permuter));
 
         for(int i=mid-1; i<temp.size(); i++)
         {
             inner_node **value_par;
             value_par = reinterpret_cast<inner_node **>(entry[temp[i]].link_or_value);
             *value_par = nr;
-            clflush((char *)value_par, sizeof(inner_node *), false, true);
         }
 
         int cmp=compare_key(key,highest);
@@ -408,7 +842,7 @@ namespace masstree
         return kv(highest,reinterpret_cast<void *>(nr));
     }
 
-    int leaf_node::rebalance(u_int64_t key, void* value)
+    int leaf_node::rebalance(u_int64_t key, void* value, std::string_view suffix)
     {
         #ifndef REBALANCE
         return 0;
@@ -437,50 +871,59 @@ namespace masstree
                 permuter temp = left->permutation.value();
                 for(int i=0; i<to_mov; i++)
                 {
-                    left->entry[temp[i+base]]=entry[permutation[i]];
-                    clflush((char *)&left->entry[temp[i+base]], sizeof(kv), false, true);
+                    left->copy_entry(temp[i+base],this,permutation[i]);
+                    persist_entry(left->entry[temp[i+base]]);
                 }
+                persist_fence();
                 temp.set_size(base+to_mov);
                 left->permutation=temp.value();
-                clflush((char *)&left->permutation, sizeof(permuter), false, true);
+                persist(&left->permutation, sizeof(permuter));
+                /* left holds the keys before this leaf drops them */
+                persist_fence();
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(left->highest);
 
                 if(to_mov==ip.i)
                 {
                     parent->entry[p_upd.p].key=key;
-                    clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     temp = permutation.value();
                     temp.rotate(0,to_mov);
                     temp.set_size(temp.size()-to_mov);
                     permutation=temp.value();
-                    clflush((char *)&permutation, sizeof(permuter), false, true);
+                    persist(&permutation, sizeof(permuter));
+                    persist_fence();
 
                     int pos=temp.insert_from_back(0);
                     entry[pos].key=key;
                     entry[pos].link_or_value=value;
-                    clflush((char *)&entry[pos], sizeof(kv), false, true);
+                    persist_entry(entry[pos]);
+                    if(!suffix.empty())
+                        set_suffix(pos,suffix);
+                    persist_fence();
                     permutation=temp.value();
-                    clflush((char *)&permutation, sizeof(permuter), false, true);
+                    persist(&permutation, sizeof(permuter));
 
                     left->highest=key;
-                    clflush((char *)&left->highest, sizeof(u_int64_t), false, true);
+                    persist(&left->highest, sizeof(u_int64_t));
+                    persist_fence();
 
                     space=(space*num_nodes+1.0/leaf_node::capacity())/num_nodes;
                 } else {
                     parent->entry[p_upd.p].key=entry[permutation[to_mov]].key;
-                    clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     temp = permutation.value();
                     temp.rotate(0,to_mov);
                     temp.set_size(temp.size()-to_mov);
                     permutation=temp.value();
-                    clflush((char *)&permutation, sizeof(permuter), false, true);
+                    persist(&permutation, sizeof(permuter));
 
                     left->highest=entry[temp[0]].key;
-                    clflush((char *)&left->highest, sizeof(u_int64_t), false, true);
-                    insert(key,value);
+                    persist(&left->highest, sizeof(u_int64_t));
+                    persist_fence();
+                    insert(key,value,suffix);
                 }
                 return 1;
             }
@@ -505,21 +948,25 @@ namespace masstree
                 temp.set_size(base+to_mov);
                 for(int i=0; i<to_mov; i++)
                 {
-                    right->entry[temp[i]]=entry[permutation[mx_sze-to_mov+i]];
-                    clflush((char *)&right->entry[temp[i]], sizeof(kv), false, true);
+                    right->copy_entry(temp[i],this,permutation[mx_sze-to_mov+i]);
+                    persist_entry(right->entry[temp[i]]);
                 }
+                persist_fence();
                 right->permutation=temp.value();
-                clflush((char *)&right->permutation, sizeof(permuter), false, true);
+                persist(&right->permutation, sizeof(permuter));
+                persist_fence();
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(highest);
                 parent->entry[p_upd.p].key=right->entry[temp[0]].key;
-                clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                 permutation.set_size(mx_sze-to_mov);
+                persist(&permutation, sizeof(permuter));
 
                 highest=right->entry[temp[0]].key;
-                clflush((char *)&highest, sizeof(u_int64_t), false, true);
-                insert(key,value);
+                persist(&highest, sizeof(u_int64_t));
+                persist_fence();
+                insert(key,value,suffix);
                 return 1;
             }
 
@@ -560,32 +1007,33 @@ namespace masstree
                 for(int i=1; i<to_mov; i++)
                 {
                     left->entry[temp[base+i]]=entry[permutation[i-1]];
-                    clflush((char *)&left->entry[temp[base+i]], sizeof(kv), false, true);
+                    persist_entry(left->entry[temp[base+i]]);
                 }
                 left->entry[temp[base]].key=parent->entry[p_upd.p].key;
                 left->entry[temp[base]].link_or_value=child0;
-                clflush((char *)&left->entry[temp[base]], sizeof(kv), false, true);
+                persist_entry(left->entry[temp[base]]);
+                /* the moved children are in place before left's permutation shows them */
+                persist_fence();
                 left->permutation=temp.value();
-                clflush((char *)&left->permutation, sizeof(permuter), false, true);
+                persist(&left->permutation, sizeof(permuter));
 
                 if(ip.i+1==to_mov)
                 {
                     parent->entry[p_upd.p].key=key;
-                    clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     child0=value;
-                    clflush((char *)&child0, sizeof(void *), false, true);
+                    persist(&child0, sizeof(void *));
                     {
                         inner_node **value_par;
                         value_par = reinterpret_cast<inner_node **>(child0);
                         *value_par = this;
-                        clflush((char *)value_par, sizeof(inner_node *), false, true);
                     }
                     temp = permutation.value();
                     temp.set_size(temp.size()-to_mov+1);
                     temp.rotate(0,to_mov-1);
                     permutation = temp.value();
-                    clflush((char *)&permutation, sizeof(permuter), false, true);
+                    persist(&permutation, sizeof(permuter));
 
                     temp=left->permutation.value();
                     for(int i=base; i<base+to_mov; i++)
@@ -593,25 +1041,25 @@ namespace masstree
                         inner_node **value_par;
                         value_par = reinterpret_cast<inner_node **>(left->entry[temp[i]].link_or_value);
                         *value_par = left;
-                        clflush((char *)value_par, sizeof(inner_node *), false, true);
                     }
 
                     left->highest=parent->entry[p_upd.p].key;
-                    clflush((char *)&left->highest, sizeof(u_int64_t), false, true);
+                    persist(&left->highest, sizeof(u_int64_t));
+                    persist_fence();
 
                     space=(space*num_nodes+1.0/inner_node::capacity())/num_nodes;
                 } else 
                 {
                     temp = permutation.value();
                     parent->entry[p_upd.p].key=entry[temp[to_mov-1]].key;
-                    clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                    persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                     child0=entry[temp[to_mov-1]].link_or_value;
-                    clflush((char *)&child0, sizeof(void *), false, true);
+                    persist(&child0, sizeof(void *));
                     temp.set_size(temp.size()-to_mov);
                     temp.rotate(0,to_mov);
                     permutation = temp.value();
-                    clflush((char *)&permutation, sizeof(permuter), false, true);
+                    persist(&permutation, sizeof(permuter));
 
                     temp = left->permutation.value();
                     for(int i=base; i<base+to_mov; i++)
@@ -619,11 +1067,10 @@ namespace masstree
                         inner_node **value_par;
                         value_par = reinterpret_cast<inner_node **>(left->entry[temp[i]].link_or_value);
                         *value_par = left;
-                        clflush((char *)value_par, sizeof(inner_node *), false, true);
                     }
 
                     left->highest=parent->entry[p_upd.p].key;
-                    clflush((char *)&left->highest, sizeof(u_int64_t), false, true);
+                    persist(&left->highest, sizeof(u_int64_t));
                     insert(key,value);
                 }
                 return 1;
@@ -650,33 +1097,33 @@ namespace masstree
                 for(int i=0; i<to_mov-1; i++)
                 {
                     right->entry[temp[i]]=entry[permutation[mx_sze-to_mov+i]];
-                    clflush((char *)&right->entry[temp[i]], sizeof(kv), false, true);
+                    persist_entry(right->entry[temp[i]]);
                 }
                 right->entry[temp[to_mov-1]].key=highest;
                 right->entry[temp[to_mov-1]].link_or_value=right->child0;
-                clflush((char *)&right->entry[temp[to_mov-1]], sizeof(kv), false, true);
+                persist_entry(right->entry[temp[to_mov-1]]);
+                persist_fence();
                 right->permutation=temp.value();
-                clflush((char *)&right->permutation, sizeof(permuter), false, true);
+                persist(&right->permutation, sizeof(permuter));
                 right->child0=entry[permutation[LEAF_WIDTH-to_mov]].link_or_value;
-                clflush((char *)&right->child0, sizeof(void *), false, true);
+                persist(&right->child0, sizeof(void *));
 
                 key_indexed_position p_upd = parent->key_lower_bound_by(highest);
                 parent->entry[p_upd.p].key = entry[permutation[LEAF_WIDTH-to_mov]].key;
-                clflush((char *)&parent->entry[p_upd.p].key, sizeof(u_int64_t), false, true);
+                persist(&parent->entry[p_upd.p].key, sizeof(u_int64_t));
 
                 permutation.set_size(LEAF_WIDTH-to_mov);
-                clflush((char *)&permutation, sizeof(permuter), false, true);
+                persist(&permutation, sizeof(permuter));
 
                 for(int i=LEAF_WIDTH-to_mov; i<LEAF_WIDTH; i++)
                 {
                     inner_node **value_par;
                     value_par = reinterpret_cast<inner_node **>(entry[permutation[i]].link_or_value);
                     *value_par = right;
-                    clflush((char *)value_par, sizeof(inner_node *), false, true);
                 }
 
                 highest=parent->entry[p_upd.p].key;
-                clflush((char *)&highest, sizeof(u_int64_t), false, true);
+                persist(&highest, sizeof(u_int64_t));
                 insert(key,value);
                 return 1;
             }
@@ -709,10 +1156,365 @@ namespace masstree
             return p;
     }
 
+    btree::iterator::iterator(btree *tree, u_int64_t start):
+        leaf(NULL),
+        pos(0)
+    {
+        void *p = tree->root_;
+
+        while(p!=NULL && tree->level(p)>0)
+            p = reinterpret_cast<inner_node *>(p)->get(start);
+        if(p==NULL)
+            return;
+        leaf = reinterpret_cast<leaf_node *>(p);
+        pos = leaf->key_lower_bound_by(start).i;
+        skip();
+    }
+
+    void btree::iterator::skip()
+    {
+        while(leaf!=NULL && pos>=leaf->permutation.size())
+        {
+            leaf = leaf->right;
+            pos = 0;
+        }
+    }
+
+    btree::iterator &btree::iterator::operator++()
+    {
+        pos++;
+        skip();
+        return *this;
+    }
+
+    int btree::scan(u_int64_t start, int count, scan_callback callback, void *arg)
+    {
+        int n=0;
+        for(iterator it(this,start); it.valid() && n<count; ++it)
+        {
+            n++;
+            if(!callback(it.key(),it.value(),arg))
+                break;
+        }
+        return n;
+    }
+
+    btree::reverse_iterator::reverse_iterator(btree *tree, u_int64_t start):
+        leaf(NULL),
+        pos(-1)
+    {
+        void *p = tree->root_;
+
+        while(p!=NULL && tree->level(p)>0)
+            p = reinterpret_cast<inner_node *>(p)->get(start);
+        if(p==NULL)
+            return;
+        leaf = reinterpret_cast<leaf_node *>(p);
+        pos = leaf->key_lower_bound(start).i;
+        skip();
+    }
+
+    void btree::reverse_iterator::skip()
+    {
+        while(leaf!=NULL && pos<0)
+        {
+            leaf = leaf->left;
+            pos = leaf==NULL ? -1 : leaf->permutation.size()-1;
+        }
+    }
+
+    btree::reverse_iterator &btree::reverse_iterator::operator++()
+    {
+        pos--;
+        skip();
+        return *this;
+    }
+
+    int btree::rscan(u_int64_t start, int count, scan_callback callback, void *arg)
+    {
+        int n=0;
+        for(reverse_iterator it(this,start); it.valid() && n<count; ++it)
+        {
+            n++;
+            if(!callback(it.key(),it.value(),arg))
+                break;
+        }
+        return n;
+    }
+
+    /* slice of key starting at byte off, see KEY_SLICE */
+    static inline u_int64_t key_slice(std::string_view key, size_t off)
+    {
+        size_t n = key.size()-off;
+        u_int64_t s = 0;
+        /* an empty view may have a null data() */
+        if(n)
+            memcpy(&s, key.data()+off, n<KEY_SLICE ? n : KEY_SLICE);
+        return __builtin_bswap64(s) | (n>KEY_SLICE ? KEY_SLICE+1 : n);
+    }
+
+    leaf_node* btree::find_leaf(u_int64_t key)
+    {
+        void *p = root_;
+
+        while(p!=NULL && level(p)>0)
+            p = reinterpret_cast<inner_node *>(p)->get(key);
+        return reinterpret_cast<leaf_node *>(p);
+    }
+
+    /* A key that goes on past its slice keeps the rest as a suffix in its
+       leaf. Only a second key on the same slice builds a layer, which takes
+       both keys and then replaces the value in place. */
+    int btree::insert(std::string_view key, void *value)
+    {
+        btree *t = this;
+        void *v;
+
+        for(size_t off=0; ; off+=KEY_SLICE)
+        {
+            u_int64_t s = key_slice(key,off);
+            if(SLICE_LEN(s)<=KEY_SLICE)
+                return t->insert(s,value);
+            std::string_view rest = key.substr(off+KEY_SLICE);
+            leaf_node *leaf = t->find_leaf(s);
+            int slot = leaf->find(s);
+            if(slot<0)
+                return t->insert(s,value,rest);
+            v = leaf->entry[slot].link_or_value;
+            if(!IS_LV(v))
+            {
+                if(leaf->suffix(slot)==rest)
+                    return 0;
+                /* init_root() and the insert fence the layer before it is linked */
+                btree *layer = new btree;
+                layer->insert(leaf->suffix(slot),v);
+                v = SET_LV(layer);
+                leaf->entry[slot].link_or_value = v;
+                persist(&leaf->entry[slot].link_or_value, sizeof(void *));
+                persist_fence();
+            }
+            t = LV_PTR(v);
+        }
+    }
+
+    void* btree::get(std::string_view key)
+    {
+        btree *t = this;
+        void *v;
+
+        for(size_t off=0; ; off+=KEY_SLICE)
+        {
+            u_int64_t s = key_slice(key,off);
+            if(SLICE_LEN(s)<=KEY_SLICE)
+                return t->get(s);
+            leaf_node *leaf = t->find_leaf(s);
+            int slot = leaf->find(s);
+            if(slot<0)
+                return NULL;
+            v = leaf->entry[slot].link_or_value;
+            if(!IS_LV(v))
+                return leaf->suffix(slot)==key.substr(off+KEY_SLICE) ? v : NULL;
+            t = LV_PTR(v);
+        }
+    }
+
+    void btree::remove(std::string_view key)
+    {
+        remove_layer(key,0);
+    }
+
+    /* the leaf and slot holding the value of key, NULL when it is missing */
+    leaf_node* btree::find_value(u_int64_t key, int &slot)
+    {
+        leaf_node *leaf = find_leaf(key);
+        slot = leaf->find(key);
+        return slot<0 ? NULL : leaf;
+    }
+
+    leaf_node* btree::find_value(std::string_view key, int &slot)
+    {
+        btree *t = this;
+        void *v;
+
+        for(size_t off=0; ; off+=KEY_SLICE)
+        {
+            u_int64_t s = key_slice(key,off);
+            leaf_node *leaf = t->find_value(s,slot);
+            if(leaf==NULL || SLICE_LEN(s)<=KEY_SLICE)
+                return leaf;
+            v = leaf->entry[slot].link_or_value;
+            if(!IS_LV(v))
+                return leaf->suffix(slot)==key.substr(off+KEY_SLICE) ? leaf : NULL;
+            t = LV_PTR(v);
+        }
+    }
+
+    int btree::upsert(u_int64_t key, void *value)
+    {
+        if(insert(key,value))
+            return 1;
+        update(key,value);
+        return 0;
+    }
+
+    int btree::update(u_int64_t key, void *value)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL)
+            return 0;
+        leaf->update(slot,value);
+        return 1;
+    }
+
+    int btree::compare_and_swap(u_int64_t key, void *expected, void *desired)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL || leaf->entry[slot].link_or_value!=expected)
+            return 0;
+        leaf->update(slot,desired);
+        return 1;
+    }
+
+    int btree::rmw(u_int64_t key, rmw_callback callback, void *arg)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL)
+            return insert(key,callback(NULL,arg));
+        leaf->update(slot,callback(leaf->entry[slot].link_or_value,arg));
+        return 0;
+    }
+
+    int btree::upsert(std::string_view key, void *value)
+    {
+        if(insert(key,value))
+            return 1;
+        update(key,value);
+        return 0;
+    }
+
+    int btree::update(std::string_view key, void *value)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL)
+            return 0;
+        leaf->update(slot,value);
+        return 1;
+    }
+
+    int btree::compare_and_swap(std::string_view key, void *expected, void *desired)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL || leaf->entry[slot].link_or_value!=expected)
+            return 0;
+        leaf->update(slot,desired);
+        return 1;
+    }
+
+    int btree::rmw(std::string_view key, rmw_callback callback, void *arg)
+    {
+        int slot;
+        leaf_node *leaf = find_value(key,slot);
+        if(leaf==NULL)
+            return insert(key,callback(NULL,arg));
+        leaf->update(slot,callback(leaf->entry[slot].link_or_value,arg));
+        return 0;
+    }
+
+    /* removes key from this layer on, true when that leaves it empty; an
+       emptied layer is unlinked before it is freed */
+    bool btree::remove_layer(std::string_view key, size_t off)
+    {
+        u_int64_t s = key_slice(key,off);
+
+        if(SLICE_LEN(s)>KEY_SLICE)
+        {
+            leaf_node *leaf = find_leaf(s);
+            int slot = leaf->find(s);
+            if(slot<0)
+                return false;
+            void *v = leaf->entry[slot].link_or_value;
+            if(IS_LV(v))
+            {
+                btree *layer = LV_PTR(v);
+                if(!layer->remove_layer(key,off+KEY_SLICE))
+                    return false;
+                remove(s);
+                leaf_node *root = reinterpret_cast<leaf_node *>(layer->root_);
+                root->drop_ksuf();
+                RRP_free(root);
+                delete layer;
+            } else
+            {
+                if(leaf->suffix(slot)!=key.substr(off+KEY_SLICE))
+                    return false;
+                remove(s);
+            }
+        } else
+            remove(s);
+        return empty();
+    }
+
+    bool btree::empty()
+    {
+        return level(root_)==0 && reinterpret_cast<leaf_node *>(root_)->empty();
+    }
+
+    int btree::scan(std::string_view start, int count, string_scan_callback callback, void *arg)
+    {
+        std::string prefix;
+        int n=0;
+        scan_layer(prefix,start,count,n,callback,arg);
+        return n;
+    }
+
+    /* scans this layer from start, the key left after prefix; a layer
+       below a slice other than the one of start is scanned whole */
+    bool btree::scan_layer(std::string &prefix, std::string_view start, int count, int &n,
+                           string_scan_callback callback, void *arg)
+    {
+        u_int64_t s = key_slice(start,0);
+        size_t len = prefix.size();
+
+        for(iterator it(this,s); it.valid(); ++it)
+        {
+            if(n>=count)
+                return false;
+            u_int64_t k = it.key();
+            u_int64_t bytes = __builtin_bswap64(k);
+            prefix.resize(len);
+            prefix.append(reinterpret_cast<char *>(&bytes), SLICE_LEN(k)<KEY_SLICE ? SLICE_LEN(k) : KEY_SLICE);
+            if(IS_LV(it.value()))
+            {
+                std::string_view rest = k==s ? start.substr(KEY_SLICE) : std::string_view();
+                if(!LV_PTR(it.value())->scan_layer(prefix,rest,count,n,callback,arg))
+                    return false;
+                continue;
+            }
+            if(SLICE_LEN(k)>KEY_SLICE)
+            {
+                if(k==s && it.suffix()<start.substr(KEY_SLICE))
+                    continue;
+                prefix.append(it.suffix());
+            }
+            n++;
+            if(!callback(prefix,it.value(),arg))
+                return false;
+        }
+        prefix.resize(len);
+        return true;
+    }
+
     int btree::level(void* node)
     {
+        /* level_ is read without knowing the node type */
+        static_assert(offsetof(leaf_node,level_)==offsetof(inner_node,level_), "level_ must share its offset");
         int level;
-        level = *reinterpret_cast<u_int32_t *>(reinterpret_cast<u_int64_t>(node)+60);
+        level = *reinterpret_cast<u_int32_t *>(reinterpret_cast<char *>(node)+offsetof(leaf_node,level_));
         return level;
     }
 
@@ -724,15 +1526,16 @@ namespace masstree
         nroot = new inner_node;
         nroot->level_=lvl+1;
         nroot->child0=root;
-        clflush((char *)nroot, sizeof(inner_node),false,true);
+        persist(nroot, sizeof(inner_node));
+        persist_fence();
 
         inner_node **value_par;
         value_par = reinterpret_cast<inner_node **>(root);
         *value_par = nroot;
-        clflush((char *)value_par,sizeof(inner_node *),false,true);
 
         root_ = reinterpret_cast<void *>(nroot);
-        clflush((char *)&root_,sizeof(void *),false,true);
+        persist(&root_, sizeof(void *));
+        persist_fence();
 
         space = (space*num_nodes+1.0/inner_node::capacity())/num_nodes;
     }
@@ -741,12 +1544,14 @@ namespace masstree
     {
         leaf_node *nroot;
         nroot = new leaf_node;
-        clflush((char *)nroot, sizeof(leaf_node), false, true);
+        persist(nroot, sizeof(leaf_node));
+        persist_fence();
         root_ = reinterpret_cast<void *>(nroot);
-        clflush((char *)&root_, sizeof(void *), false, true);
+        persist(&root_, sizeof(void *));
+        persist_fence();
     }
 
-    int btree::insert(u_int64_t key, void* value)
+    int btree::insert(u_int64_t key, void* value, std::string_view suffix)
     {
         kv to_insert;
         void *p=root_;
@@ -786,10 +1591,10 @@ namespace masstree
                 } else 
                 {
                     //printf("trying leaf rebalancing\n");
-                    if(leaf->rebalance(key,value))
+                    if(leaf->rebalance(key,value,suffix))
                         return 1;
                     //printf("trying leaf split\n");
-                    to_insert = leaf->split(key,value);
+                    to_insert = leaf->split(key,value,suffix);
                     key = to_insert.key;
                     value = to_insert.link_or_value;
                     
@@ -799,7 +1604,7 @@ namespace masstree
             } else 
             {
                 //printf("leaf inserting\n");
-                leaf->insert(key,value);
+                leaf->insert(key,value,suffix);
                 //printf("leaf inserted\n");
                 return 1;
             }
@@ -866,6 +1671,7 @@ namespace masstree
             if(leaf->parent==NULL)
                 return;
             
+            leaf->drop_ksuf();
             leaf->del();
             key = leaf->highest;
             inner = leaf->parent;
@@ -879,7 +1685,7 @@ namespace masstree
             {
                 void *snap = root_;
                 init_root();
-                free(snap);
+                RRP_free(snap);
                 return;
             }
             
@@ -889,21 +1695,327 @@ namespace masstree
             goto inner_delete;
     }
 
+    /* Recovery treats the leaf chain and the leaf permutations as the truth.
+       An interrupted split or rebalance leaves keys in two neighbours, and an
+       interrupted remove leaves an empty leaf behind; both are cleaned up
+       pairwise along the chain. The inner levels are then checked against
+       the chain and only rebuilt from it when they disagree. Parent and left
+       pointers are not kept durable and are rewritten here. */
+    void btree::collect(void *node, std::vector<void *> &leaves, std::vector<void *> &inners)
+    {
+        /* the header fields below are read without knowing the node type */
+        static_assert(offsetof(leaf_node,highest)==offsetof(inner_node,highest), "highest must share its offset");
+        static_assert(offsetof(leaf_node,parent)==offsetof(inner_node,parent), "parent must share its offset");
+        static_assert(offsetof(leaf_node,right)==offsetof(inner_node,right), "right must share its offset");
+        static_assert(offsetof(leaf_node,left)==offsetof(inner_node,left), "left must share its offset");
+
+        if(level(node)==0)
+        {
+            leaves.push_back(node);
+            return;
+        }
+        inner_node *inner = reinterpret_cast<inner_node *>(node);
+        permuter perm = inner->permutation.value();
+        inners.push_back(node);
+        if(inner->child0==NULL)
+            return;
+        collect(inner->child0,leaves,inners);
+        for(int i=0; i<perm.size(); i++)
+            collect(inner->entry[perm[i]].link_or_value,leaves,inners);
+    }
+
+    /* drops keys of a that b holds too and puts a fence between them,
+       returns true when that leaves a empty */
+    bool btree::repair_pair(leaf_node *a, leaf_node *b)
+    {
+        permuter perm = a->permutation.value();
+        u_int64_t bmin = b->entry[b->permutation[0]].key;
+
+        for(int i=perm.size()-1; i>=0 && a->entry[perm[i]].key>=bmin; i--)
+            if(b->get(a->entry[perm[i]].key))
+                perm.remove(i);
+        if(perm.value()!=a->permutation.value())
+        {
+            a->permutation = perm.value();
+            persist(&a->permutation, sizeof(permuter));
+            persist_fence();
+        }
+        if((perm.size()>0 && a->entry[perm[perm.size()-1]].key>=a->highest) || a->highest>bmin)
+        {
+            a->highest = bmin;
+            persist(&a->highest, sizeof(u_int64_t));
+            persist_fence();
+        }
+        return perm.size()==0;
+    }
+
+    /* walks the tree level by level; with fix set, parent pointers are
+       rewritten instead of checked and nothing is printed */
+    bool btree::check(bool fix)
+    {
+        std::vector<void *> cur(1,root_), next;
+        const char *why = NULL;
+        int lvl = level(root_);
+        u_int64_t lo = 0;
+
+        if(reinterpret_cast<inner_node *>(root_)->highest!=UINT64_MAX)
+        {
+            why = "root fence is not the largest key";
+            goto fail;
+        }
+        if(reinterpret_cast<inner_node *>(root_)->parent!=NULL)
+        {
+            if(!fix)
+            {
+                why = "root has a parent";
+                goto fail;
+            }
+            reinterpret_cast<inner_node *>(root_)->parent = NULL;
+            persist(root_, sizeof(void *));
+            persist_fence();
+        }
+
+        for(;;)
+        {
+            for(size_t i=0; i<cur.size(); i++)
+            {
+                inner_node *n = reinterpret_cast<inner_node *>(cur[i]);
+                permuter perm = n->permutation.value();
+                void *c = n->child0;
+
+                if(level(n)!=lvl)
+                {
+                    why = "node on the wrong level";
+                    goto fail;
+                }
+                if(n->right!=(i+1<cur.size() ? cur[i+1] : NULL) || n->left!=(i>0 ? cur[i-1] : NULL))
+                {
+                    why = "sibling links out of key order";
+                    goto fail;
+                }
+                if(lvl==0)
+                    continue;
+                if(c==NULL)
+                {
+                    why = "empty inner node";
+                    goto fail;
+                }
+                for(int r=0; ; r++)
+                {
+                    inner_node *child = reinterpret_cast<inner_node *>(c);
+                    if(child->highest!=(r<perm.size() ? n->entry[perm[r]].key : n->highest))
+                    {
+                        why = "child fence differs from its separator";
+                        goto fail;
+                    }
+                    if(child->parent!=n)
+                    {
+                        if(!fix)
+                        {
+                            why = "stale parent pointer";
+                            goto fail;
+                        }
+                        child->parent = n;
+                        persist(&child->parent, sizeof(inner_node *));
+                        persist_fence();
+                    }
+                    next.push_back(c);
+                    if(r==perm.size())
+                        break;
+                    c = n->entry[perm[r]].link_or_value;
+                }
+            }
+            if(lvl==0)
+                break;
+            lvl--;
+            cur.swap(next);
+            next.clear();
+        }
+
+        if(fix)
+            return true;
+        for(size_t i=0; i<cur.size(); i++)
+        {
+            leaf_node *leaf = reinterpret_cast<leaf_node *>(cur[i]);
+            permuter perm = leaf->permutation.value();
+            if(perm.size()==0 && cur.size()>1)
+            {
+                why = "empty leaf";
+                goto fail;
+            }
+            for(int r=0; r<perm.size(); r++)
+            {
+                u_int64_t key = leaf->entry[perm[r]].key;
+                if(key<lo || key>=leaf->highest)
+                {
+                    why = "key outside its leaf fences";
+                    goto fail;
+                }
+                lo = key+1;
+            }
+            lo = leaf->highest;
+        }
+        return true;
+
+    fail:
+        if(!fix)
+            fprintf(stderr,"verify: %s (level %d)\n",why,lvl);
+        return false;
+    }
+
+    bool btree::verify()
+    {
+        if(!check(false))
+            return false;
+        for(iterator it(this,0); it.valid(); ++it)
+            if(IS_LV(it.value()) && !LV_PTR(it.value())->verify())
+                return false;
+        return true;
+    }
+
+    void btree::recover()
+    {
+        std::vector<void *> order, inners, garbage;
+        std::vector<leaf_node *> chain, leaves;
+        leaf_node *leaf;
+        bool again, rebuild;
+
+        collect(root_,order,inners);
+        if(order.empty())
+        {
+            leaf = new leaf_node;
+            persist(leaf, sizeof(leaf_node));
+            persist_fence();
+        } else
+            leaf = reinterpret_cast<leaf_node *>(order[0]);
+        for(; leaf!=NULL; leaf=leaf->right)
+            chain.push_back(leaf);
+
+        /* emptying a leaf gives its neighbours a new pair */
+        do
+        {
+            leaves.clear();
+            for(size_t i=0; i<chain.size(); i++)
+            {
+                if(!chain[i]->empty() || (leaves.empty() && i+1==chain.size()))
+                    leaves.push_back(chain[i]);
+                else
+                    garbage.push_back(chain[i]);
+            }
+            again = false;
+            for(size_t i=0; i+1<leaves.size(); i++)
+                again |= repair_pair(leaves[i],leaves[i+1]);
+            chain.swap(leaves);
+        } while(again);
+
+        for(size_t i=0; i<chain.size(); i++)
+        {
+            leaf_node *right = i+1<chain.size() ? chain[i+1] : NULL;
+            leaf_node *left = i>0 ? chain[i-1] : NULL;
+            if(chain[i]->right!=right)
+            {
+                chain[i]->right = right;
+                persist(&chain[i]->right, sizeof(leaf_node *));
+                persist_fence();
+            }
+            if(chain[i]->left!=left)
+            {
+                chain[i]->left = left;
+                persist(&chain[i]->left, sizeof(leaf_node *));
+                persist_fence();
+            }
+        }
+        if(chain.back()->highest!=UINT64_MAX)
+        {
+            chain.back()->highest = UINT64_MAX;
+            persist(&chain.back()->highest, sizeof(u_int64_t));
+            persist_fence();
+        }
+
+        rebuild = !check(true);
+        if(rebuild)
+        {
+            std::vector<void *> cur(chain.begin(),chain.end()), next;
+            u_int32_t lvl = 0;
+
+            garbage.insert(garbage.end(),order.begin(),order.end());
+            garbage.insert(garbage.end(),inners.begin(),inners.end());
+            while(cur.size()>1)
+            {
+                size_t groups = (cur.size()+inner_node::capacity()-1)/inner_node::capacity();
+                inner_node *prev = NULL;
+                for(size_t g=0, i=0; g<groups; g++)
+                {
+                    size_t cnt = (cur.size()-i)/(groups-g);
+                    inner_node *n = new inner_node(NULL,NULL,prev,lvl+1);
+                    n->child0 = cur[i];
+                    for(size_t j=1; j<cnt; j++)
+                    {
+                        n->entry[j-1].key = reinterpret_cast<inner_node *>(cur[i+j-1])->highest;
+                        n->entry[j-1].link_or_value = cur[i+j];
+                    }
+                    n->permutation = permuter::make_sorted(cnt-1);
+                    n->highest = reinterpret_cast<inner_node *>(cur[i+cnt-1])->highest;
+                    for(size_t j=0; j<cnt; j++)
+                    {
+                        reinterpret_cast<inner_node *>(cur[i+j])->parent = n;
+                        persist(cur[i+j], sizeof(inner_node *));
+                    }
+                    if(prev)
+                        prev->right = n;
+                    next.push_back(n);
+                    prev = n;
+                    i += cnt;
+                }
+                for(size_t i=0; i<next.size(); i++)
+                    persist(next[i], sizeof(inner_node));
+                persist_fence();
+                cur.swap(next);
+                next.clear();
+                lvl++;
+            }
+            reinterpret_cast<inner_node *>(cur[0])->parent = NULL;
+            persist(cur[0], sizeof(void *));
+            persist_fence();
+            root_ = cur[0];
+            persist(&root_, sizeof(void *));
+            persist_fence();
+        }
+
+        std::sort(chain.begin(),chain.end());
+        std::sort(garbage.begin(),garbage.end());
+        garbage.erase(std::unique(garbage.begin(),garbage.end()),garbage.end());
+        for(size_t i=0; i<garbage.size(); i++)
+        {
+            if(std::binary_search(chain.begin(),chain.end(),reinterpret_cast<leaf_node *>(garbage[i])))
+                continue;
+            /* a dropped leaf takes its suffix block with it */
+            if(level(garbage[i])==0)
+                reinterpret_cast<leaf_node *>(garbage[i])->drop_ksuf();
+            RRP_free(garbage[i]);
+        }
+
+        /* the layers of string keys are trees of their own */
+        for(iterator it(this,0); it.valid(); ++it)
+            if(IS_LV(it.value()))
+                LV_PTR(it.value())->recover();
+    }
+
     void* btree::operator new(size_t size)
     {
-        void *ptr = malloc(size);
+        void *ptr = RRP_malloc(size);
         memset(ptr,0,size);
         return ptr;
     }
 
     void btree::operator delete(void *addr)
     {
-        free(addr);
+        RRP_free(addr);
     }
 
     void* leaf_node::operator new(size_t size)
     {
-        void *ptr = malloc(size);
+        void *ptr = RRP_malloc(size);
         memset(ptr,0,size);
         
         space=space*num_nodes;
@@ -915,12 +2027,12 @@ namespace masstree
 
     void leaf_node::operator delete(void *addr)
     {
-        free(addr);
+        RRP_free(addr);
     }
 
     void* inner_node::operator new(size_t size)
     {
-        void *ptr = malloc(size);
+        void *ptr = RRP_malloc(size);
         memset(ptr,0,size);
         
         space=space*num_nodes;
@@ -932,7 +2044,7 @@ namespace masstree
 
     void inner_node::operator delete(void *addr)
     {
-        free(addr);
+        RRP_free(addr);
     }
 
     u_int64_t btree::node_count()
@@ -1,14 +1,23 @@
 #include <cstdio>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <math.h>
 #include <iostream>
 #include <mutex>
 #include <atomic>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
 #include <assert.h>
 #include <emmintrin.h>
+#include <immintrin.h>
+#include <cpuid.h>
 
 #define REBALANCE
+#define SIMD_SEARCH
+#define SPLIT_KV
 
 namespace masstree
 {
@@ -16,14 +25,36 @@ namespace masstree
 #define LEAF_WIDTH          15
 #define LEAF_THRESHOLD      1
 
+/* cache lines one operation queues before they are written back early */
+#define FLUSH_SET           32
+
 #define INITIAL_VALUE       0x0123456789ABCDE0ULL
 #define FULL_VALUE          0xEDCBA98765432100ULL
 
+/* a leaf value tagged LV is the next layer of a string key, a btree */
 #define LV_BITS             (1ULL << 0)
 #define IS_LV(x)            ((uintptr_t)x & LV_BITS)
-#define LV_PTR(x)           (leafvalue*)((void*)((uintptr_t)x & ~LV_BITS))
+#define LV_PTR(x)           ((btree*)((void*)((uintptr_t)x & ~LV_BITS)))
 #define SET_LV(x)           ((void*)((uintptr_t)x | LV_BITS))
 
+/* a leaf value tagged IV is the value itself, up to 62 bits, and is never
+   freed or read through by the tree */
+#define IV_BITS             (1ULL << 1)
+#define IS_IV(x)            ((uintptr_t)(x) & IV_BITS)
+#define IV_GET(x)           ((u_int64_t)((uintptr_t)(x) >> 2))
+#define SET_IV(x)           ((void*)(((uintptr_t)(x) << 2) | IV_BITS))
+
+/* String keys are cut into slices of KEY_SLICE bytes, one slice per layer.
+   A slice holds its bytes big endian above the low byte, which is the
+   count of key bytes left if at most KEY_SLICE, else KEY_SLICE+1 and the
+   key goes on in the next layer. Slices then order as their keys do, and
+   keys that end inside a slice differ from those padded with zeros. */
+#define KEY_SLICE           7
+#define SLICE_LEN(x)        ((x) & 0xff)
+
+/* data bytes of the first suffix block of a leaf */
+#define KSUF_SIZE           256
+
 #define INSERT_LOCK 0b1ULL
 #define SMO_LOCK 0b10ULL
 #define BOTH_LOCKS 0b11ULL
@@ -40,7 +71,7 @@ namespace masstree
 #define SMO_INCREMENT 0x1000000ULL
 
 
-uint64_t lock_version=100;
+extern uint64_t lock_version;
 
 
 class VersionNumber {
@@ -354,6 +385,19 @@ typedef struct key_indexed_position
     }
 } key_indexed_position;
 
+/* instruction set used by the node search kernels, picked at startup */
+enum search_isa { SEARCH_SCALAR, SEARCH_SSE42, SEARCH_AVX2 };
+
+search_isa get_search_isa();
+bool set_search_isa(search_isa isa);
+
+/* cache line write back used to persist, picked at startup; FLUSH_NONE
+   leaves the lines in the cache, for runs on DRAM */
+enum flush_isa { FLUSH_NONE, FLUSH_CLFLUSH, FLUSH_CLFLUSHOPT, FLUSH_CLWB };
+
+flush_isa get_flush_isa();
+bool set_flush_isa(flush_isa isa);
+
 class kv
 {
     private:
@@ -370,6 +414,36 @@ class kv
         friend class btree;
 };
 
+#ifdef SPLIT_KV
+/* Struct-of-arrays node body: the 15 keys fill two cache lines on their own,
+   so a search never touches the values. entry[i] hands out a kv_ref that
+   reads and assigns like a kv. */
+class kv_ref
+{
+    public:
+        u_int64_t   &key;
+        void        *&link_or_value;
+
+        kv_ref(u_int64_t &key, void *&value):key(key),link_or_value(value){}
+        kv_ref &operator=(const kv_ref &e) {
+            key=e.key;
+            link_or_value=e.link_or_value;
+            return *this;
+        }
+};
+
+class kv_array
+{
+    public:
+        u_int64_t   key[LEAF_WIDTH];                                //120B
+        void        *link_or_value[LEAF_WIDTH];                     //120B
+
+        kv_ref operator[](int i) {
+            return kv_ref(key[i],link_or_value[i]);
+        }
+};
+#endif
+
 class inner_node
 {
     private:
@@ -382,7 +456,11 @@ class inner_node
         void                    *child0;                            //8B
         u_int32_t               dummy;                              //4B
         u_int32_t               level_;                             //4B
+#ifdef SPLIT_KV
+        kv_array                entry;                              //240B
+#else
         kv                      entry[LEAF_WIDTH];                  //240B
+#endif
 
     public:
 
@@ -432,6 +510,21 @@ class inner_node
         
 };
 
+/* Suffixes of the string keys of one leaf: the bytes past the slice of a
+   slot whose key goes on but has no layer of its own. Suffixes are only
+   appended; a block without room is replaced by a compacted copy. */
+class ksuf_block
+{
+    public:
+        u_int32_t   capacity;
+        u_int32_t   used;
+        u_int32_t   off[LEAF_WIDTH];
+        u_int32_t   len[LEAF_WIDTH];
+        char        data[];
+
+        std::string_view get(int slot){return std::string_view(data+off[slot],len[slot]);}
+};
+
 class leaf_node
 {
     private:
@@ -441,9 +534,14 @@ class leaf_node
         std::atomic<uint64_t>   typeVersionLockObsolete{0b100};     //8B
         u_int64_t               highest;                            //8B
         permuter                permutation;                        //8B
-        u_int32_t               dummy[3];                           //12B
+        ksuf_block              *ksuf;                              //8B
+        u_int32_t               dummy;                              //4B
         u_int32_t               level_;                             //4B
+#ifdef SPLIT_KV
+        kv_array                entry;                              //240B
+#else
         kv                      entry[LEAF_WIDTH];                  //240B
+#endif
     
     public:
 
@@ -453,7 +551,8 @@ class leaf_node
             left(NULL),
             highest(UINT64_MAX),
             level_(0),
-            permutation(permuter::make_empty())
+            permutation(permuter::make_empty()),
+            ksuf(NULL)
             {}
 
         leaf_node(void *parent, void *right, void *left, u_int32_t level):
@@ -462,7 +561,8 @@ class leaf_node
             left(reinterpret_cast<leaf_node *>(left)),
             level_(level),
             highest(UINT64_MAX),
-            permutation(permuter::make_empty())
+            permutation(permuter::make_empty()),
+            ksuf(NULL)
             {}
 
         void *operator new(size_t size);
@@ -473,13 +573,21 @@ class leaf_node
         key_indexed_position key_lower_bound(uint64_t key);
 
         int size();
-        void insert(u_int64_t key, void* value);
-        kv split(u_int64_t key, void* value);
-        int rebalance(u_int64_t key, void* value);
+        void insert(u_int64_t key, void* value, std::string_view suffix);
+        kv split(u_int64_t key, void* value, std::string_view suffix);
+        int rebalance(u_int64_t key, void* value, std::string_view suffix);
         int remove(u_int64_t key);
         inner_node* give_parent();
         void del();
         void* get(u_int64_t key);
+        int find(u_int64_t key);
+        void update(int slot, void *value);
+
+        bool has_suffix(int slot);
+        std::string_view suffix(int slot){return ksuf->get(slot);}
+        void set_suffix(int slot, std::string_view suffix);
+        void copy_entry(int slot, leaf_node *from, int from_slot);
+        void drop_ksuf();
 
         int full(){return permutation.size()==LEAF_WIDTH;}
         int empty(){return permutation.size()==0;}
@@ -489,29 +597,126 @@ class leaf_node
         friend class inner_node;
 };
 
+/* built with -DCRASH_SIM the tree takes nodes from sim_malloc() and reports
+   every flushed cache line and every fence to the simulated persistent heap
+   of crash_test.cc, which defines these; site is the flushing code */
+#ifdef CRASH_SIM
+void* sim_malloc(size_t size);
+void sim_free(void *ptr);
+void sim_flush(void *line, void *site);
+void sim_fence(void *site);
+#endif
+
+/* called for every entry of a scan in key order, return false to stop */
+typedef bool (*scan_callback)(u_int64_t key, void *value, void *arg);
+/* given the value of a key, NULL when it is missing, returns the one to
+   store; it must not call into the tree */
+typedef void* (*rmw_callback)(void *value, void *arg);
+typedef bool (*string_scan_callback)(std::string_view key, void *value, void *arg);
+
 class btree
 {
     private:
         void *root_;
 
     public:
+        /* walks the leaf chain in key order from the first key >= start;
+           any insert or remove on the tree invalidates it */
+        class iterator
+        {
+            private:
+                leaf_node   *leaf;
+                int         pos;
+
+                void skip();
+
+            public:
+                iterator(btree *tree, u_int64_t start);
+
+                bool valid(){return leaf!=NULL;}
+                u_int64_t key(){return leaf->entry[leaf->permutation[pos]].key;}
+                void* value(){return leaf->entry[leaf->permutation[pos]].link_or_value;}
+                std::string_view suffix(){return leaf->suffix(leaf->permutation[pos]);}
+                iterator &operator++();
+        };
+
+        /* same walk in descending key order from the last key <= start,
+           following the left sibling links */
+        class reverse_iterator
+        {
+            private:
+                leaf_node   *leaf;
+                int         pos;
+
+                void skip();
+
+            public:
+                reverse_iterator(btree *tree, u_int64_t start);
+
+                bool valid(){return leaf!=NULL;}
+                u_int64_t key(){return leaf->entry[leaf->permutation[pos]].key;}
+                void* value(){return leaf->entry[leaf->permutation[pos]].link_or_value;}
+                reverse_iterator &operator++();
+        };
+
         btree(){init_root();}
         btree(void *root):root_(root){}
         void *operator new(size_t size);
         void operator delete(void *addr);
 
-        int insert(u_int64_t key, void *value);
+        int insert(u_int64_t key, void *value){return insert(key,value,std::string_view());}
         void remove(u_int64_t key);
         void* get(u_int64_t key);
+        /* values of present keys are replaced in place without an SMO; the
+           tree frees the old one as remove() would. upsert() returns 1 when
+           it inserted and 0 when it replaced */
+        int upsert(u_int64_t key, void *value);
+        int update(u_int64_t key, void *value);
+        int compare_and_swap(u_int64_t key, void *expected, void *desired);
+        /* applies callback to the value of key, inserting its result when
+           key is missing; returns 1 only then */
+        int rmw(u_int64_t key, rmw_callback callback, void *arg);
+        int scan(u_int64_t start, int count, scan_callback callback, void *arg);
+        int rscan(u_int64_t start, int count, scan_callback callback, void *arg);
+
+        /* string keys; a tree holds either these or u_int64_t keys */
+        int insert(std::string_view key, void *value);
+        void remove(std::string_view key);
+        void* get(std::string_view key);
+        int upsert(std::string_view key, void *value);
+        int update(std::string_view key, void *value);
+        int compare_and_swap(std::string_view key, void *expected, void *desired);
+        int rmw(std::string_view key, rmw_callback callback, void *arg);
+        int scan(std::string_view start, int count, string_scan_callback callback, void *arg);
+
+        iterator lower_bound(u_int64_t start){return iterator(this,start);}
+        iterator begin(){return iterator(this,0);}
+        reverse_iterator rbegin(u_int64_t start=UINT64_MAX){return reverse_iterator(this,start);}
 
         int height(){return level(root_)+1;}
         u_int64_t node_count();
         double space_used();
 
+        /* run once on a tree found after a crash, before any other call */
+        void recover();
+        /* checks the tree invariants, printing the first broken one */
+        bool verify();
+
     private:
         void new_root();
         int level(void *node);
         void init_root();
+        void collect(void *node, std::vector<void *> &leaves, std::vector<void *> &inners);
+        bool repair_pair(leaf_node *a, leaf_node *b);
+        bool check(bool fix);
+        bool empty();
+        int insert(u_int64_t key, void *value, std::string_view suffix);
+        leaf_node* find_leaf(u_int64_t key);
+        leaf_node* find_value(u_int64_t key, int &slot);
+        leaf_node* find_value(std::string_view key, int &slot);
+        bool remove_layer(std::string_view key, size_t off);
+        bool scan_layer(std::string &prefix, std::string_view start, int count, int &n,
+                        string_scan_callback callback, void *arg);
 };
 
 }
\ No newline at end of file
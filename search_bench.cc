@@ -0,0 +1,72 @@
+#include <iostream>
+#include <time.h>
+
+using namespace std;
+
+#include "masstree.h"
+
+static __uint128_t g_lehmer64_state;
+
+static void init_seed(void) {
+   srand(time(NULL));
+   g_lehmer64_state = rand();
+}
+
+static uint64_t lehmer64() {
+  g_lehmer64_state *= 0xda942042e4dd58b5;
+  return g_lehmer64_state >> 64;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static const char *isa_name[] = {"scalar", "sse4.2", "avx2"};
+
+int main(int argc, char **argv)
+{
+    int num_keys = 1000000;
+    int num_lookups = 10000000;
+    if(argc>1)
+        num_keys = atoi(argv[1]);
+    if(argc>2)
+        num_lookups = atoi(argv[2]);
+
+    masstree::btree tree;
+    u_int64_t *keys = new u_int64_t[num_keys];
+    u_int64_t *probes = new u_int64_t[num_lookups];
+
+    init_seed();
+    for(int i=0; i<num_keys; i++)
+    {
+        keys[i]=lehmer64();
+        tree.insert(keys[i],malloc(4));
+    }
+    for(int i=0; i<num_lookups; i++)
+        probes[i] = (i&1) ? keys[lehmer64()%num_keys] : lehmer64();
+
+    cout<<"number of keys: "<<num_keys<<", height: "<<tree.height()<<"\n";
+
+    masstree::search_isa best = masstree::get_search_isa();
+    u_int64_t expect=0;
+    for(int isa=masstree::SEARCH_SCALAR; isa<=best; isa++)
+    {
+        masstree::set_search_isa((masstree::search_isa)isa);
+        u_int64_t found=0;
+        double start=now();
+        for(int i=0; i<num_lookups; i++)
+            found+=(tree.get(probes[i])!=NULL);
+        double elapsed=now()-start;
+        if(isa==masstree::SEARCH_SCALAR)
+            expect=found;
+        cout<<isa_name[isa]<<": "<<elapsed*1e9/num_lookups<<" ns/lookup, "
+            <<num_lookups/elapsed/1e6<<"M lookups/s, found "<<found
+            <<(found==expect ? "" : " (MISMATCH)")<<"\n";
+    }
+    masstree::set_search_isa(best);
+
+    return 0;
+}